@@ -3,6 +3,12 @@
 #include <bitset>
 #include <utility>
 
+#include <chrono>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
 #include <cstdint>
 #include <cstdlib>
 
@@ -33,25 +39,44 @@ namespace Arch {
 			std::ostringstream str_stream; \
 			str_stream << msg; \
 			const std::string str = str_stream.str(); \
-			terminal->print_str(Arch::Terminal::Type::type, str); \
+			Arch::get_terminal()->print_str(Arch::Terminal::Type::type, str); \
 		}
 
 	#define terminal_println(type, msg) terminal_print(type, msg << std::endl)
 #endif
 
+// per-instruction tracing, compiled out of the hot path in headless builds
+#ifdef CONFIG_HEADLESS
+	#define trace_print(msg)
+	#define trace_println(msg)
+#else
+	#define trace_print(msg) terminal_print(Arch, msg)
+	#define trace_println(msg) terminal_println(Arch, msg)
+#endif
+
 // ---------------------------------------
 
-static Terminal *terminal = nullptr;
-static Cpu *cpu = nullptr;
-static Memory memory;
-static Timer timer;
-static volatile bool alive = true;
-static uint64_t cycle = 0;
+static thread_local Machine *machine = nullptr;
+static std::unique_ptr<Machine> owned_machine; // see init
+static thread_local uint32_t core_id = 0;
 static std::string turn_off_msg;
+static Engine engine = Engine::Switch;
+
+// ---------------------------------------
+
+static void terminal_end ()
+{
+	if (machine != nullptr && machine->get_terminal() != nullptr)
+		machine->get_terminal()->stop_renderer();
+
+#ifndef CONFIG_HEADLESS
+	endwin();
+#endif
+}
 
 // ---------------------------------------
 
-static const char* get_reg_name_str (const uint16_t code)
+[[maybe_unused]] static const char* get_reg_name_str (const uint16_t code)
 {
 	static constexpr auto strs = std::to_array<const char*>({
 		"r0",
@@ -74,7 +99,8 @@ const char* InterruptCode_str (const InterruptCode code)
 	static constexpr auto strs = std::to_array<const char*>({
 		"Keyboard",
 		"Timer",
-		"GPF"
+		"GPF",
+		"PageFault"
 		});
 
 	mylib_assert_exception_msg(std::to_underlying(code) < strs.size(), "invalid interrupt code ", std::to_underlying(code))
@@ -82,6 +108,35 @@ const char* InterruptCode_str (const InterruptCode code)
 	return strs[ std::to_underlying(code) ];
 }
 
+const char* Handler_str (const Handler handler)
+{
+	static constexpr auto strs = std::to_array<const char*>({
+		"add",
+		"sub",
+		"mul",
+		"div",
+		"cmp_equal",
+		"cmp_neq",
+		"load",
+		"store",
+		"syscall",
+		"jump",
+		"jump_cond",
+		"mov",
+		"cmp_equal+jump_cond",
+		"cmp_neq+jump_cond",
+		"mov+load",
+		"mov+store",
+		"invalid"
+		});
+
+	static_assert(strs.size() == std::to_underlying(Handler::Count));
+
+	mylib_assert_exception_msg(std::to_underlying(handler) < strs.size(), "invalid handler ", std::to_underlying(handler))
+
+	return strs[ std::to_underlying(handler) ];
+}
+
 // ---------------------------------------
 
 VideoOutput::VideoOutput (const uint32_t xinit, const uint32_t xend, const uint32_t yinit, const uint32_t yend)
@@ -91,14 +146,21 @@ VideoOutput::VideoOutput (const uint32_t xinit, const uint32_t xend, const uint3
 
 	this->buffer = MatrixBuffer(h - 2, w - 2);
 	this->buffer.set_all(' ');
+	this->head = 0;
+
+	this->dirty_rows.assign(this->buffer.get_nrows(), false);
+	this->dirty = true;
+	this->all_dirty = true;
 
 	this->x = 0;
 	this->y = 0;
 
+#ifndef CONFIG_HEADLESS
 	this->win = newwin(h, w, yinit, xinit);
 	refresh();
 	box(this->win, 0, 0);
 	wrefresh(this->win);
+#endif
 
 	this->update();
 }
@@ -138,15 +200,17 @@ void VideoOutput::print (const std::string_view str)
 			this->x = 0;
 
 			for (uint32_t i = 0; i < ncols; i++)
-				this->buffer(this->y, i) = ' ';
+				this->cell(this->y, i) = ' ';
+
+			this->mark_dirty(this->y);
 		}
 		else {
-			this->buffer(this->y, this->x) = str[i];
+			this->cell(this->y, this->x) = str[i];
 			this->x++;
+
+			this->mark_dirty(this->y);
 		}
 	}
-
-	this->update();
 }
 
 void VideoOutput::roll ()
@@ -154,28 +218,46 @@ void VideoOutput::roll ()
 	const auto nrows = this->buffer.get_nrows();
 	const auto ncols = this->buffer.get_ncols();
 
-	for (uint32_t row = 1; row < nrows; row++) {
-		for (uint32_t col = 0; col < ncols; col++)
-			this->buffer(row-1, col) = this->buffer(row, col);
-	}
+	// the old first row becomes the last one
+	this->head = this->buffer_row(1);
 
 	// clear last line
 	for (uint32_t col = 0; col < ncols; col++)
-		this->buffer(nrows-1, col) = ' ';
+		this->cell(nrows-1, col) = ' ';
+
+	// every row moved
+	this->all_dirty = true;
+	this->dirty = true;
 }
 
 void VideoOutput::update ()
 {
+	if (!this->dirty)
+		return;
+
 	const auto nrows = this->buffer.get_nrows();
-	const auto ncols = this->buffer.get_ncols();
 
 	for (uint32_t row = 0; row < nrows; row++) {
+		if (!this->all_dirty && !this->dirty_rows[row])
+			continue;
+
+	#ifndef CONFIG_HEADLESS
+		const auto ncols = this->buffer.get_ncols();
+
+		wmove(this->win, row+1, 1);
 		for (uint32_t col = 0; col < ncols; col++)
-			mvwprintw(this->win, row+1, col+1, "%c", this->buffer(row, col));
+			waddch(this->win, this->cell(row, col));
+	#endif
+
+		this->dirty_rows[row] = false;
 	}
 
-	refresh();
-	wrefresh(this->win);
+#ifndef CONFIG_HEADLESS
+	wnoutrefresh(this->win);
+#endif
+
+	this->dirty = false;
+	this->all_dirty = false;
 }
 
 void VideoOutput::dump () const
@@ -185,7 +267,7 @@ void VideoOutput::dump () const
 
 	for (uint32_t row = 0; row < nrows; row++) {
 		for (uint32_t col = 0; col < ncols; col++)
-			std::cout << this->buffer(row, col);
+			std::cout << this->cell(row, col);
 		std::cout << std::endl;
 	}
 }
@@ -194,8 +276,13 @@ void VideoOutput::dump () const
 
 Terminal::Terminal ()
 {
+#ifdef CONFIG_HEADLESS
+	const uint32_t total_w = Config::headless_terminal_cols;
+	const uint32_t total_h = Config::headless_terminal_rows;
+#else
 	const uint32_t total_w = COLS;
 	const uint32_t total_h = LINES;
+#endif
 
 	this->videos.reserve( std::to_underlying(Type::Count) );
 
@@ -212,23 +299,272 @@ Terminal::Terminal ()
 	this->videos.emplace_back(2*(total_w/3) + 1, total_w, 1, total_h);
 
 	this->has_char = false;
+
+	this->redraw();
+
+#ifndef CONFIG_HEADLESS
+	if constexpr (Config::render_thread) {
+		this->async = true;
+		this->renderer = std::thread(&Terminal::render_loop, this);
+	}
+#endif
 }
 
 Terminal::~Terminal ()
 {
+	this->stop_renderer();
+}
+
+void Terminal::flush ()
+{
+	std::unique_lock<std::mutex> lock(this->mutex, std::defer_lock);
+
+	if (this->shared)
+		lock.lock();
+
+	if (!this->async)
+		this->redraw();
+}
+
+void Terminal::flush_if_due ()
+{
+	std::unique_lock<std::mutex> lock(this->mutex, std::defer_lock);
+
+	if (this->shared)
+		lock.lock();
+
+	if (!this->async)
+		this->redraw_if_due();
+}
+
+void Terminal::redraw ()
+{
+	for (auto& video: this->videos)
+		video.update();
+
+#ifndef CONFIG_HEADLESS
+	doupdate();
+#endif
+
+	this->last_flush = std::chrono::steady_clock::now();
+}
+
+void Terminal::redraw_if_due ()
+{
+	static constexpr auto frame_time = std::chrono::microseconds(1000000 / Config::terminal_max_fps);
+
+	if ((std::chrono::steady_clock::now() - this->last_flush) >= frame_time)
+		this->redraw();
 }
 
-void Terminal::run_cycle ()
+bool Terminal::wait_char (const std::chrono::milliseconds max_wait)
 {
+	const auto deadline = std::chrono::steady_clock::now() + max_wait;
+
+	if (this->has_char)
+		return true;
+
+	if (this->async) {
+		// the renderer thread reads the keyboard and redraws on its own
+		int typed;
+
+		while (true) {
+			if (this->has_render_pending)
+				this->render_flush_pending();
+
+			if (this->input_queue.pop(typed)) {
+				this->type_char(typed);
+				return true;
+			}
+
+			if (std::chrono::steady_clock::now() >= deadline)
+				return false;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	this->redraw();
+
+#ifdef CONFIG_HEADLESS
+	// no keyboard in headless mode
+	return false;
+#else
+	wtimeout(stdscr, max_wait.count());
 	const int typed = getch();
+	wtimeout(stdscr, 0);
+
+	if (typed == ERR)
+		return false;
 
-	if (typed != ERR) {
-		this->has_char = true;
-		this->typed_char = typed;
+	this->type_char(typed);
+
+	return true;
+#endif
+}
+
+bool Terminal::run_cycle ()
+{
+	std::unique_lock<std::mutex> lock(this->mutex, std::defer_lock);
+
+	if (this->shared)
+		lock.lock();
+
+	if (this->async) {
+		if (this->has_render_pending)
+			this->render_flush_pending();
+
+		int typed;
+
+		if (!this->has_char && this->input_queue.pop(typed) && this->keyboard) {
+			this->has_char = true;
+			this->typed_char = typed;
+		}
+	}
+	else {
+	#ifdef CONFIG_HEADLESS
+		// no keyboard in headless mode
+		const int typed = -1;
+	#else
+		const int typed = getch();
+	#endif
+
+		if (typed >= 0 && this->keyboard) {
+			this->has_char = true;
+			this->typed_char = typed;
+		}
 	}
 
-	if (this->has_char)
-		cpu->interrupt(InterruptCode::Keyboard);
+	return this->has_char && machine->get_cpu()->interrupt(InterruptCode::Keyboard);
+}
+
+// renderer thread
+void Terminal::render_loop ()
+{
+	RenderRecord record;
+
+	while (true) {
+		// read the flag before draining, so output queued before the stop is drawn
+		const bool stop = this->renderer_stop.load(std::memory_order_acquire);
+		bool idle = true;
+
+		while (this->render_queue.pop(record)) {
+			this->videos[ std::to_underlying(record.video) ].print( std::string_view(record.text.data(), record.len) );
+			idle = false;
+		}
+
+	#ifndef CONFIG_HEADLESS
+		const int typed = getch();
+
+		if (typed != ERR) {
+			this->input_queue.push(typed); // a key typed while 64 are pending is lost
+			idle = false;
+		}
+	#endif
+
+		if (stop)
+			break;
+
+		this->redraw_if_due();
+
+		if (idle)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	this->redraw();
+}
+
+void Terminal::render_push (const Type video, const std::string_view str)
+{
+	using enum Config::RenderBackpressure;
+
+	if constexpr (Config::render_backpressure == Block) {
+		uint32_t pos = 0;
+
+		while ((pos += this->render_enqueue(video, str.substr(pos))) < str.size())
+			std::this_thread::yield();
+	}
+	else if constexpr (Config::render_backpressure == Drop) {
+		this->render_dropped_chars += str.size() - this->render_enqueue(video, str);
+	}
+	else {
+		std::string& pending = this->render_pending[ std::to_underlying(video) ];
+
+		// pending output of this video goes first
+		if (pending.empty()) {
+			const uint32_t pos = this->render_enqueue(video, str);
+
+			if (pos == str.size())
+				return;
+
+			pending.assign(str.substr(pos));
+		}
+		else
+			pending.append(str);
+
+		// only the newest output can still be on screen
+		if (pending.size() > Config::render_coalesce_max_chars) {
+			const auto excess = pending.size() - Config::render_coalesce_max_chars;
+			pending.erase(0, excess);
+			this->render_dropped_chars += excess;
+		}
+
+		this->has_render_pending = true;
+	}
+}
+
+// returns how many chars were queued
+uint32_t Terminal::render_enqueue (const Type video, const std::string_view str)
+{
+	RenderRecord record;
+	uint32_t pos = 0;
+
+	record.video = video;
+
+	while (pos < str.size()) {
+		record.len = std::min<std::size_t>(record.text.size(), str.size() - pos);
+		std::copy_n(str.data() + pos, record.len, record.text.data());
+
+		if (!this->render_queue.push(record))
+			break;
+
+		pos += record.len;
+	}
+
+	return pos;
+}
+
+void Terminal::render_flush_pending ()
+{
+	this->has_render_pending = false;
+
+	for (uint32_t i = 0; i < this->render_pending.size(); i++) {
+		std::string& pending = this->render_pending[i];
+
+		if (pending.empty())
+			continue;
+
+		pending.erase(0, this->render_enqueue(static_cast<Type>(i), pending));
+
+		if (!pending.empty())
+			this->has_render_pending = true;
+	}
+}
+
+void Terminal::stop_renderer ()
+{
+	if (!this->async)
+		return;
+
+	while (this->has_render_pending) {
+		this->render_flush_pending();
+		std::this_thread::yield();
+	}
+
+	this->renderer_stop.store(true, std::memory_order_release);
+	this->renderer.join();
+
+	this->async = false;
 }
 
 // ---------------------------------------
@@ -237,6 +573,8 @@ Memory::Memory ()
 {
 	for (auto& v: this->data)
 		v = 0;
+
+	this->clear_dirty();
 }
 
 Memory::~Memory ()
@@ -244,6 +582,23 @@ Memory::~Memory ()
 	
 }
 
+void Memory::mark_dirty (const uint32_t paddr, const uint32_t nwords)
+{
+	mylib_assert_exception_msg((paddr + nwords) <= Config::memsize_words, "dirty range out of memory bounds ", paddr, " ", nwords)
+
+	if (nwords == 0)
+		return;
+
+	for (uint32_t page = paddr / Config::page_size_words; page <= (paddr + nwords - 1) / Config::page_size_words; page++)
+		this->dirty[page].store(1, std::memory_order_relaxed);
+}
+
+void Memory::clear_dirty ()
+{
+	for (auto& d: this->dirty)
+		d.store(0, std::memory_order_relaxed);
+}
+
 void Memory::dump (const uint16_t init, const uint16_t end) const
 {
 	terminal_println(Arch, "memory dump from paddr " << init << " to " << end)
@@ -254,14 +609,100 @@ void Memory::dump (const uint16_t init, const uint16_t end) const
 
 // ---------------------------------------
 
-void Timer::run_cycle ()
+bool Timer::run_cycle (Cpu& cpu)
 {
 	if (this->count >= Config::timer_interrupt_cycles) {
-		if (cpu->interrupt(InterruptCode::Timer))
+		if (cpu.interrupt(InterruptCode::Timer)) {
 			this->count = 0;
+			return true;
+		}
 	}
 	else
 		this->count++;
+
+	return false;
+}
+
+// ---------------------------------------
+
+static constexpr std::array<uint16_t, 4> event_log_magic = {'A' | ('R' << 8), 'Q' | ('E' << 8), 'V' | ('T' << 8), 0}; // "ARQEVT"
+static constexpr uint16_t event_log_version = 1;
+static constexpr uint16_t event_log_keyboard = 1 << 15;
+static constexpr uint16_t event_log_long_delta = 1 << 14;
+static constexpr uint16_t event_log_delta_mask = event_log_long_delta - 1;
+
+EventLog::EventLog (const std::string_view fname)
+{
+	const Lib::MappedFile file(fname);
+	Lib::WordReader in(file.words());
+
+	const std::span<const uint16_t> magic = in.get_words(event_log_magic.size());
+	const bool valid = std::equal(magic.begin(), magic.end(), event_log_magic.begin()) && (in.get() == event_log_version);
+	mylib_assert_exception_msg(valid, fname, " is not an event recording of this version")
+
+	this->start_cycle = in.get64();
+	this->end_cycle = in.get64();
+	this->events.resize(in.get32());
+
+	uint64_t cycle = this->start_cycle;
+
+	for (Event& event: this->events) {
+		const uint16_t word = in.get();
+		const uint64_t delta = (word & event_log_long_delta) ? in.get64() : (word & event_log_delta_mask);
+
+		// one interrupt per cycle at most, the others are raised later
+		mylib_assert_exception_msg(delta > 0 || &event == this->events.data(), "events out of order in ", fname)
+
+		cycle += delta;
+		event.cycle = cycle;
+		event.code = (word & event_log_keyboard) ? InterruptCode::Keyboard : InterruptCode::Timer;
+		event.key = (word & event_log_keyboard) ? in.get() : 0;
+	}
+
+	mylib_assert_exception_msg(cycle <= this->end_cycle && in.at_end(), "invalid event recording ", fname)
+}
+
+void EventLog::write_file (const std::string_view fname, const uint64_t end_cycle) const
+{
+	Lib::WordWriter out;
+	uint64_t cycle = this->start_cycle;
+
+	out.put_words(event_log_magic);
+	out.put(event_log_version);
+	out.put64(this->start_cycle);
+	out.put64(end_cycle);
+	out.put32(this->events.size());
+
+	for (const Event& event: this->events) {
+		const uint64_t delta = event.cycle - cycle;
+		const uint16_t kind = (event.code == InterruptCode::Keyboard) ? event_log_keyboard : 0;
+
+		if (delta <= event_log_delta_mask)
+			out.put(kind | delta);
+		else {
+			out.put(kind | event_log_long_delta);
+			out.put64(delta);
+		}
+
+		if (event.code == InterruptCode::Keyboard)
+			out.put(event.key);
+
+		cycle = event.cycle;
+	}
+
+	out.write_file(fname);
+}
+
+// ---------------------------------------
+
+std::unique_lock<std::mutex> Machine::kernel_lock ()
+{
+	std::unique_lock<std::mutex> lock(this->kernel_mutex, std::defer_lock);
+
+	if (this->ncores > 1)
+		lock.lock();
+
+	return lock;
 }
 
 // ---------------------------------------
@@ -270,11 +711,11 @@ void Timer::run_cycle ()
 
 static void fake_syscall_handler ()
 {
-	const uint16_t syscall = cpu->get_gpr(0);
+	const uint16_t syscall = machine->get_cpu()->get_gpr(0);
 
 	if (syscall == 0) {
 		terminal_println(Kernel, "halt service called")
-		alive = false;
+		machine->turn_off();
 	}
 	else
 		terminal_println(Kernel, "unknown service " << syscall << " called")
@@ -284,11 +725,25 @@ static void fake_syscall_handler ()
 
 // ---------------------------------------
 
-Cpu::Cpu ()
-	: memory(Arch::memory)
+Cpu::Cpu (Machine& machine, const uint32_t core_id)
+	: core_id(core_id), machine(machine), memory(machine.get_memory())
 {
 	for (auto& r: this->gprs)
 		r = 0;
+
+	for (auto& instruction: this->decode_cache)
+		instruction.valid = false;
+
+	this->fusion_count.fill(0);
+	this->fusion_fallback_count.fill(0);
+
+	this->profile.opcode_r_hits.fill(0);
+	this->profile.opcode_i_hits.fill(0);
+	this->profile.loads = 0;
+	this->profile.stores = 0;
+
+	for (auto& entry: this->tlb)
+		entry.valid = false;
 }
 
 Cpu::~Cpu ()
@@ -298,47 +753,164 @@ Cpu::~Cpu ()
 
 void Cpu::run_cycle ()
 {
-	enum class InstrType : uint16_t {
-		R = 0,
-		I = 1
-	};
-
 	if (this->has_interrupt) { // check first if external interrupt
-		this->has_interrupt = false;
-		OS::interrupt(this->interrupt_code);
+		this->deliver_interrupt();
+		return;
+	}
+
+	if (this->halted) {
+		this->halted_cycles++;
 		return;
 	}
 
-	const Mylib::BitSet<16> instruction = this->vmem_read(this->pc);
+	uint16_t paddr;
 
-	if (this->has_interrupt) {
-		this->has_interrupt = false;
-		OS::interrupt(this->interrupt_code);
+	if (!this->fetch_address(paddr)) {
+		this->deliver_interrupt();
 		return;
 	}
 
-	terminal_println(Arch, "\tPC = " << this->pc << " instr 0x" << std::hex << instruction.underlying() << std::dec << " binary " << instruction.underlying())
+	const DecodedInstruction instruction = this->fetch(paddr);
+	const uint16_t pc = this->pc;
+
+	if (this->profiling) [[unlikely]]
+		this->profile_instruction(paddr, instruction);
+
+	trace_println("\tPC = " << this->pc << " instr 0x" << std::hex << instruction.raw << std::dec << " binary " << instruction.raw)
 	
 	this->pc++;
 
-	const InstrType type = static_cast<InstrType>( instruction[15] );
-
-	if (type == InstrType::R)
+	if (instruction.type == InstrType::R)
 		this->execute_r(instruction);
 	else
 		this->execute_i(instruction);
 
-	if (this->has_interrupt) {
-		this->has_interrupt = false;
-		OS::interrupt(this->interrupt_code);
-	}
+	if (this->tracing) [[unlikely]]
+		this->trace_instruction(pc, instruction);
+
+	if (this->has_interrupt)
+		this->deliver_interrupt();
 
-	this->dump();
+#ifndef CONFIG_HEADLESS
+	if (this->core_id == 0)
+		this->dump();
+#endif
 }
 
 void Cpu::turn_off ()
 {
-	alive = false;
+	this->machine.turn_off();
+}
+
+void Cpu::pmem_copy (const uint16_t paddr, const std::span<const uint16_t> words)
+{
+	mylib_assert_exception_msg((paddr + words.size()) <= Config::memsize_words, "copy out of memory bounds ", paddr, " ", words.size())
+
+	std::copy(words.begin(), words.end(), this->memory.get_raw() + paddr);
+	this->memory.mark_dirty(paddr, words.size());
+
+	this->invalidate_decode_cache(paddr, words.size());
+
+	// the copy is to memory no other core runs, they see it only after a dispatch
+	for (Cpu *cpu: this->machine.get_cpus()) {
+		if (cpu != this)
+			cpu->pending_invalidations.emplace_back(paddr, words.size());
+	}
+}
+
+std::unique_lock<std::mutex> Cpu::kernel_lock ()
+{
+	std::unique_lock<std::mutex> lock = this->machine.kernel_lock();
+
+	for (const auto& [paddr, nwords]: this->pending_invalidations)
+		this->invalidate_decode_cache(paddr, nwords);
+
+	this->pending_invalidations.clear();
+
+	return lock;
+}
+
+void Cpu::invalidate_decode_cache (const uint16_t paddr, const uint32_t nwords)
+{
+	mylib_assert_exception_msg((paddr + nwords) <= Config::memsize_words, "invalidation out of memory bounds ", paddr, " ", nwords)
+
+	// the instruction before paddr may be fused with the first word
+	for (uint32_t i = (paddr > 0) ? (paddr - 1) : 0; i < (paddr + nwords); i++)
+		this->decode_cache[i].valid = false;
+}
+
+void Cpu::set_mmu_mode (const MmuMode mode)
+{
+	this->mmu_mode = mode;
+
+	// the fused handlers check the second instruction against vmem_paddr_end,
+	// in paged mode fusion never crosses a page, so the bound must not get in the way
+	if (mode == MmuMode::Paged) {
+		this->vmem_paddr_init = 0;
+		this->vmem_paddr_end = Config::memsize_words - 1;
+	}
+
+	this->flush_tlb();
+}
+
+void Cpu::set_page_table (const PageTableEntry *table, const uint32_t npages)
+{
+	this->page_table = table;
+	this->page_table_size = npages;
+	this->flush_tlb();
+}
+
+void Cpu::flush_tlb ()
+{
+	for (auto& entry: this->tlb)
+		entry.valid = false;
+
+	this->tlb_flushes++;
+}
+
+void Cpu::save_state (Lib::WordWriter& out) const
+{
+	for (const uint16_t r: this->gprs)
+		out.put(r);
+
+	out.put(this->pc);
+	out.put(this->vmem_paddr_init);
+	out.put(this->vmem_paddr_end);
+	out.put(this->vmem_text_words);
+	out.put(std::to_underlying(this->mmu_mode));
+	out.put(this->has_interrupt);
+	out.put(this->has_interrupt ? std::to_underlying(this->interrupt_code) : 0);
+	out.put(this->fault_vaddr);
+	out.put(this->halted);
+}
+
+void Cpu::restore_state (Lib::WordReader& in)
+{
+	for (uint16_t& r: this->gprs)
+		r = in.get();
+
+	this->pc = in.get();
+	this->vmem_paddr_init = in.get();
+	this->vmem_paddr_end = in.get();
+	this->vmem_text_words = in.get();
+
+	const uint16_t mmu_mode = in.get();
+	mylib_assert_exception_msg(mmu_mode <= std::to_underlying(MmuMode::Paged), "invalid mmu mode ", mmu_mode)
+	this->mmu_mode = static_cast<MmuMode>(mmu_mode);
+
+	this->has_interrupt = (in.get() != 0);
+
+	const uint16_t interrupt_code = in.get();
+	mylib_assert_exception_msg(interrupt_code <= std::to_underlying(InterruptCode::PageFault), "invalid interrupt code ", interrupt_code)
+	this->interrupt_code = static_cast<InterruptCode>(interrupt_code);
+
+	this->fault_vaddr = in.get();
+	this->halted = (in.get() != 0);
+
+	// the machine invalidates the decoded instructions of the memory it changes
+	this->page_table = nullptr;
+	this->page_table_size = 0;
+	this->flush_tlb();
 }
 
 bool Cpu::interrupt (const InterruptCode interrupt_code)
@@ -347,6 +919,7 @@ bool Cpu::interrupt (const InterruptCode interrupt_code)
 		return false;
 	this->interrupt_code = interrupt_code;
 	this->has_interrupt = true;
+	this->halted = false;
 	return true;
 }
 
@@ -356,118 +929,670 @@ void Cpu::force_interrupt (const InterruptCode interrupt_code)
 	this->interrupt(interrupt_code);
 }
 
-void Cpu::execute_r (const Mylib::BitSet<16> instruction)
+void Cpu::deliver_interrupt ()
 {
-	enum class OpcodeR : uint16_t {
-		Add = 0,
-		Sub = 1,
-		Mul = 2,
-		Div = 3,
-		Cmp_equal = 4,
-		Cmp_neq = 5,
-		Load = 15,
-		Store = 16,
-		Syscall = 63
-	};
+	this->has_interrupt = false;
 
-	const OpcodeR opcode = static_cast<OpcodeR>( instruction(9, 6) );
-	const uint16_t dest = instruction(6, 3);
-	const uint16_t op1 = instruction(3, 3);
-	const uint16_t op2 = instruction(0, 3);
+	if (this->tracing) [[unlikely]]
+		this->trace_interrupt(this->interrupt_code);
 
-	switch (opcode) {
-		using enum OpcodeR;
+	const auto lock = this->kernel_lock();
+	OS::interrupt(this->interrupt_code);
+}
 
-		case Add:
-			terminal_println(Arch, "\tadd " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
-			this->gprs[dest] = this->gprs[op1] + this->gprs[op2];
+// ---------------------------------------
+
+static const char* opcode_str (const InstrType type, const uint8_t opcode)
+{
+	if (type == InstrType::R) {
+		switch (static_cast<OpcodeR>(opcode)) {
+			using enum OpcodeR;
+
+			case Add:       return "add";
+			case Sub:       return "sub";
+			case Mul:       return "mul";
+			case Div:       return "div";
+			case Cmp_equal: return "cmp_equal";
+			case Cmp_neq:   return "cmp_neq";
+			case Load:      return "load";
+			case Store:     return "store";
+			case Syscall:   return "syscall";
+		}
+	}
+	else {
+		switch (static_cast<OpcodeI>(opcode)) {
+			using enum OpcodeI;
+
+			case Jump:      return "jump";
+			case Jump_cond: return "jump_cond";
+			case Mov:       return "mov";
+		}
+	}
+
+	return "unknown";
+}
+
+void Cpu::set_profiling (const bool enabled)
+{
+	if (enabled && this->profile.pc_hits.empty())
+		this->profile.pc_hits.resize(Config::memsize_words, 0);
+
+	this->profiling = enabled;
+}
+
+void Cpu::profile_instruction (const uint16_t paddr, const DecodedInstruction instruction)
+{
+	this->profile.pc_hits[paddr]++;
+
+	if (instruction.type == InstrType::R) {
+		this->profile.opcode_r_hits[instruction.opcode]++;
+
+		if (static_cast<OpcodeR>(instruction.opcode) == OpcodeR::Load)
+			this->profile.loads++;
+		else if (static_cast<OpcodeR>(instruction.opcode) == OpcodeR::Store)
+			this->profile.stores++;
+	}
+	else
+		this->profile.opcode_i_hits[instruction.opcode]++;
+
+	if (this->profile_owner >= this->profile.process_cycles.size())
+		this->profile.process_cycles.resize(this->profile_owner + 1, 0);
+
+	this->profile.process_cycles[this->profile_owner]++;
+}
+
+void write_profile_report (const Profile& profile, std::ostream& out, const uint32_t top_n)
+{
+	struct Entry {
+		std::string name;
+		uint64_t count;
+	};
+
+	const auto print_top = [&out, top_n] (std::vector<Entry>& entries) {
+		const uint32_t n = std::min<std::size_t>(top_n, entries.size());
+
+		std::partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+			[] (const Entry& a, const Entry& b) { return a.count > b.count; });
+
+		for (uint32_t i = 0; i < n; i++)
+			out << "  " << entries[i].name << ": " << entries[i].count << std::endl;
+	};
+
+	uint64_t total = 0;
+	std::vector<Entry> entries;
+
+	for (uint32_t paddr = 0; paddr < profile.pc_hits.size(); paddr++) {
+		if (profile.pc_hits[paddr] > 0) {
+			entries.push_back({ Mylib::build_str_from_stream("paddr ", paddr), profile.pc_hits[paddr] });
+			total += profile.pc_hits[paddr];
+		}
+	}
+
+	out << "profile: " << total << " instructions, " << profile.loads << " loads, " << profile.stores << " stores" << std::endl;
+	out << "hot pcs:" << std::endl;
+	print_top(entries);
+
+	entries.clear();
+
+	for (uint32_t opcode = 0; opcode < profile.opcode_r_hits.size(); opcode++) {
+		if (profile.opcode_r_hits[opcode] > 0)
+			entries.push_back({ opcode_str(InstrType::R, opcode), profile.opcode_r_hits[opcode] });
+	}
+
+	for (uint32_t opcode = 0; opcode < profile.opcode_i_hits.size(); opcode++) {
+		if (profile.opcode_i_hits[opcode] > 0)
+			entries.push_back({ opcode_str(InstrType::I, opcode), profile.opcode_i_hits[opcode] });
+	}
+
+	out << "hot opcodes:" << std::endl;
+	print_top(entries);
+
+	out << "cycles per process:" << std::endl;
+
+	for (uint32_t id = 0; id < profile.process_cycles.size(); id++) {
+		if (profile.process_cycles[id] > 0)
+			out << "  pid " << id << ": " << profile.process_cycles[id] << std::endl;
+	}
+}
+
+void Cpu::set_trace (const bool enabled)
+{
+	if (enabled && this->trace_ring.empty())
+		this->trace_ring.resize(Config::trace_ring_size);
+
+	this->tracing = enabled;
+}
+
+void Cpu::trace_instruction (const uint16_t pc, const DecodedInstruction instruction)
+{
+	TraceRecord& record = this->trace_next();
+
+	record.cycle = this->machine.get_cycle(this->core_id);
+	record.pc = pc;
+	record.raw = instruction.raw;
+	record.kind = TraceRecord::Kind::Instruction;
+	record.reg = TraceRecord::no_reg;
+	record.reg_value = 0;
+
+	bool writes_reg;
+
+	if (instruction.type == InstrType::R) {
+		const OpcodeR opcode = static_cast<OpcodeR>(instruction.opcode);
+		writes_reg = (opcode != OpcodeR::Store) && (opcode != OpcodeR::Syscall);
+	}
+	else
+		writes_reg = (static_cast<OpcodeI>(instruction.opcode) == OpcodeI::Mov);
+
+	if (writes_reg) {
+		record.reg = instruction.dest;
+		record.reg_value = this->gprs[instruction.dest];
+	}
+}
+
+void Cpu::trace_interrupt (const InterruptCode interrupt_code)
+{
+	TraceRecord& record = this->trace_next();
+
+	record.cycle = this->machine.get_cycle(this->core_id);
+	record.pc = this->pc;
+	record.raw = std::to_underlying(interrupt_code);
+	record.kind = TraceRecord::Kind::Interrupt;
+	record.reg = TraceRecord::no_reg;
+	record.reg_value = 0;
+}
+
+static constexpr char trace_file_magic[8] = { 'A', 'R', 'Q', 'T', 'R', 'A', 'C', 'E' };
+static constexpr uint32_t trace_file_version = 1;
+
+void Cpu::dump_trace (const std::string_view fname) const
+{
+	const uint64_t nrecords = std::min<uint64_t>(this->trace_count, this->trace_ring.size());
+	const uint64_t first = this->trace_count - nrecords;
+
+	FILE *fp = fopen(std::string(fname).c_str(), "wb");
+
+	mylib_assert_exception_msg(fp != nullptr, "cannot write file ", fname)
+
+	fwrite(trace_file_magic, sizeof(trace_file_magic), 1, fp);
+	fwrite(&trace_file_version, sizeof(trace_file_version), 1, fp);
+	fwrite(&nrecords, sizeof(nrecords), 1, fp);
+
+	for (uint64_t i = first; i < this->trace_count; i++)
+		fwrite(&this->trace_ring[ i & (Config::trace_ring_size - 1) ], sizeof(TraceRecord), 1, fp);
+
+	fclose(fp);
+}
+
+void decode_trace_file (const std::string_view fname, std::ostream& out)
+{
+	char magic[sizeof(trace_file_magic)];
+	uint32_t version;
+	uint64_t nrecords;
+
+	FILE *fp = fopen(std::string(fname).c_str(), "rb");
+
+	mylib_assert_exception_msg(fp != nullptr, "cannot load file ", fname)
+
+	const bool header_ok = (fread(magic, sizeof(magic), 1, fp) == 1)
+		&& (fread(&version, sizeof(version), 1, fp) == 1)
+		&& (fread(&nrecords, sizeof(nrecords), 1, fp) == 1)
+		&& std::equal(magic, magic + sizeof(magic), trace_file_magic)
+		&& (version == trace_file_version);
+
+	if (!header_ok) {
+		fclose(fp);
+		throw Mylib::Exception(Mylib::build_str_from_stream(fname, " is not a trace file"));
+	}
+
+	for (uint64_t i = 0; i < nrecords; i++) {
+		TraceRecord record;
+
+		if (fread(&record, sizeof(record), 1, fp) != 1)
+			break;
+
+		out << "cycle " << record.cycle << " pc " << record.pc << ": ";
+
+		if (record.kind == TraceRecord::Kind::Interrupt)
+			out << "interrupt " << InterruptCode_str( static_cast<InterruptCode>(record.raw) );
+		else {
+			out << "0x" << std::hex << record.raw << std::dec << " " << disassemble(record.raw);
+
+			if (record.reg != TraceRecord::no_reg)
+				out << " ; " << get_reg_name_str(record.reg) << " = " << record.reg_value;
+		}
+
+		out << std::endl;
+	}
+
+	fclose(fp);
+}
+
+std::string disassemble (const uint16_t raw)
+{
+	const DecodedInstruction instruction = Cpu::decode(raw);
+	const char *name = opcode_str(instruction.type, instruction.opcode);
+	const char *dest = get_reg_name_str(instruction.dest);
+	const char *op1 = get_reg_name_str(instruction.op1);
+	const char *op2 = get_reg_name_str(instruction.op2);
+
+	if (instruction.type == InstrType::R) {
+		switch (static_cast<OpcodeR>(instruction.opcode)) {
+			using enum OpcodeR;
+
+			case Add:
+			case Sub:
+			case Mul:
+			case Div:
+			case Cmp_equal:
+			case Cmp_neq:
+				return Mylib::build_str_from_stream(name, " ", dest, ", ", op1, ", ", op2);
+
+			case Load:  return Mylib::build_str_from_stream(name, " ", dest, ", [", op1, "]");
+			case Store: return Mylib::build_str_from_stream(name, " [", op1, "], ", op2);
+			default:    return name;
+		}
+	}
+	else if (static_cast<OpcodeI>(instruction.opcode) == OpcodeI::Jump)
+		return Mylib::build_str_from_stream(name, " ", instruction.imed);
+	else
+		return Mylib::build_str_from_stream(name, " ", dest, ", ", instruction.imed);
+}
+
+DecodedInstruction Cpu::decode (const Mylib::BitSet<16> instruction)
+{
+	DecodedInstruction decoded;
+
+	decoded.raw = instruction.underlying();
+	decoded.type = static_cast<InstrType>( instruction[15] );
+
+	if (decoded.type == InstrType::R) {
+		decoded.opcode = instruction(9, 6);
+		decoded.dest = instruction(6, 3);
+		decoded.op1 = instruction(3, 3);
+		decoded.op2 = instruction(0, 3);
+		decoded.imed = 0;
+
+		switch (static_cast<OpcodeR>(decoded.opcode)) {
+			using enum OpcodeR;
+
+			case Add:       decoded.handler = Handler::Add; break;
+			case Sub:       decoded.handler = Handler::Sub; break;
+			case Mul:       decoded.handler = Handler::Mul; break;
+			case Div:       decoded.handler = Handler::Div; break;
+			case Cmp_equal: decoded.handler = Handler::Cmp_equal; break;
+			case Cmp_neq:   decoded.handler = Handler::Cmp_neq; break;
+			case Load:      decoded.handler = Handler::Load; break;
+			case Store:     decoded.handler = Handler::Store; break;
+			case Syscall:   decoded.handler = Handler::Syscall; break;
+			default:        decoded.handler = Handler::Invalid;
+		}
+	}
+	else {
+		decoded.opcode = instruction(13, 2);
+		decoded.dest = instruction(10, 3);
+		decoded.op1 = 0;
+		decoded.op2 = 0;
+		decoded.imed = instruction(0, 9);
+
+		switch (static_cast<OpcodeI>(decoded.opcode)) {
+			using enum OpcodeI;
+
+			case Jump:      decoded.handler = Handler::Jump; break;
+			case Jump_cond: decoded.handler = Handler::Jump_cond; break;
+			case Mov:       decoded.handler = Handler::Mov; break;
+			default:        decoded.handler = Handler::Invalid;
+		}
+	}
+
+	decoded.valid = true;
+
+	return decoded;
+}
+
+/*
+	Fusion pass, applied when an instruction is decoded.
+	Recognizes the idioms
+		cmp_equal/cmp_neq rd, ra, rb + jump_cond rd, imed
+		mov rx, imed + load rd, [rx]
+		mov rx, imed + store [rx], rs
+	and turns the first instruction into a superinstruction. The operands
+	of the second instruction go in the fields the first one leaves unused.
+	Only the threaded engine executes the fused handlers; writes to
+	either word invalidate the fused record (see pmem_write).
+*/
+
+void Cpu::fuse (DecodedInstruction& first, const DecodedInstruction second)
+{
+	if (first.handler == Handler::Cmp_equal || first.handler == Handler::Cmp_neq) {
+		if (second.handler == Handler::Jump_cond && second.dest == first.dest) {
+			first.handler = (first.handler == Handler::Cmp_equal) ? Handler::Cmp_equal_jump_cond : Handler::Cmp_neq_jump_cond;
+			first.imed = second.imed;
+		}
+	}
+	else if (first.handler == Handler::Mov) {
+		if (second.handler == Handler::Load && second.op1 == first.dest) {
+			first.handler = Handler::Mov_load;
+			first.op2 = second.dest;
+		}
+		else if (second.handler == Handler::Store && second.op1 == first.dest) {
+			first.handler = Handler::Mov_store;
+			first.op2 = second.op2;
+		}
+	}
+}
+
+void Cpu::execute_r (const DecodedInstruction instruction)
+{
+	const OpcodeR opcode = static_cast<OpcodeR>(instruction.opcode);
+	const uint16_t dest = instruction.dest;
+	const uint16_t op1 = instruction.op1;
+	const uint16_t op2 = instruction.op2;
+
+	switch (opcode) {
+		using enum OpcodeR;
+
+		case Add:
+			trace_println("\tadd " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			this->gprs[dest] = this->gprs[op1] + this->gprs[op2];
 		break;
 
 		case Sub:
-			terminal_println(Arch, "\tsub " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			trace_println("\tsub " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
 			this->gprs[dest] = this->gprs[op1] - this->gprs[op2];
 		break;
 
 		case Mul:
-			terminal_println(Arch, "\tmul " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			trace_println("\tmul " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
 			this->gprs[dest] = this->gprs[op1] * this->gprs[op2];
 		break;
 
 		case Div:
-			terminal_println(Arch, "\tdiv " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			trace_println("\tdiv " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
 			this->gprs[dest] = this->gprs[op1] / this->gprs[op2];
 		break;
 
 		case Cmp_equal:
-			terminal_println(Arch, "\tcmp_equal " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			trace_println("\tcmp_equal " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
 			this->gprs[dest] = (this->gprs[op1] == this->gprs[op2]);
 		break;
 
 		case Cmp_neq:
-			terminal_println(Arch, "\tcmp_neq " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
+			trace_println("\tcmp_neq " << get_reg_name_str(dest) << ", " << get_reg_name_str(op1) << ", " << get_reg_name_str(op2))
 			this->gprs[dest] = (this->gprs[op1] != this->gprs[op2]);
 		break;
 
 		case Load:
-			terminal_println(Arch, "\tload " << get_reg_name_str(dest) << ", [" << get_reg_name_str(op1) << "]")
-			this->gprs[dest] = this->vmem_read( this->gprs[op1] );
+		{
+			trace_println("\tload " << get_reg_name_str(dest) << ", [" << get_reg_name_str(op1) << "]")
+			const uint16_t value = this->vmem_read( this->gprs[op1] );
+
+			// dest is kept on a fault, the load may be restarted
+			if (!this->has_interrupt) [[likely]]
+				this->gprs[dest] = value;
+		}
 		break;
 
 		case Store:
-			terminal_println(Arch, "\tstore [" << get_reg_name_str(op1) << "], " << get_reg_name_str(op2))
+			trace_println("\tstore [" << get_reg_name_str(op1) << "], " << get_reg_name_str(op2))
 			this->vmem_write(this->gprs[op1], this->gprs[op2]);
 		break;
 
 		case Syscall:
-			terminal_println(Arch, "\tsyscall");
+			trace_println("\tsyscall");
 			#ifdef CPU_DEBUG_MODE
 				fake_syscall_handler();
 			#else
+			{
+				const auto lock = this->kernel_lock();
 				OS::syscall();
+			}
 			#endif
 		break;
 
 		default:
-			mylib_assert_exception_diecode_msg(false, endwin();, "Unknown opcode ", static_cast<uint16_t>(opcode));
+			mylib_assert_exception_diecode_msg(false, terminal_end();, "Unknown opcode ", static_cast<uint16_t>(opcode));
 	}
 }
 
-void Cpu::execute_i (const Mylib::BitSet<16> instruction)
+void Cpu::execute_i (const DecodedInstruction instruction)
 {
-	enum class OpcodeI : uint16_t {
-		Jump = 0,
-		Jump_cond = 1,
-		Mov = 3
-	};
-
-	const OpcodeI opcode = static_cast<OpcodeI>( instruction(13, 2) );
-	const uint16_t reg = instruction(10, 3);
-	const uint16_t imed = instruction(0, 9);
+	const OpcodeI opcode = static_cast<OpcodeI>(instruction.opcode);
+	const uint16_t reg = instruction.dest;
+	const uint16_t imed = instruction.imed;
 
 	switch (opcode) {
 		using enum OpcodeI;
 
 		case Jump:
-			terminal_println(Arch, "\tjump " << imed)
+			trace_println("\tjump " << imed)
 			this->pc = imed;
 		break;
 
 		case Jump_cond:
-			terminal_println(Arch, "\tjump_cond " << get_reg_name_str(reg) << ", " << imed)
+			trace_println("\tjump_cond " << get_reg_name_str(reg) << ", " << imed)
 			if (this->gprs[reg] == 1)
 				this->pc = imed;
 		break;
 
 		case Mov:
-			terminal_println(Arch, "\tmov " << get_reg_name_str(reg) << ", " << imed)
+			trace_println("\tmov " << get_reg_name_str(reg) << ", " << imed)
 			this->gprs[reg] = imed;
 		break;
 
 		default:
-			mylib_assert_exception_diecode_msg(false, endwin();, "Unknown opcode ", static_cast<uint16_t>(opcode));
+			mylib_assert_exception_diecode_msg(false, terminal_end();, "Unknown opcode ", static_cast<uint16_t>(opcode));
+	}
+}
+
+/*
+	Threaded engine.
+	Runs up to max_cycles instructions, dispatching through a handler
+	table indexed by the predecoded instruction, with computed goto
+	when the compiler supports it.
+	Interrupts raised by an instruction (GPF, syscalls) are delivered
+	right after it, as in run_cycle, and end the run. External
+	interrupts are only raised between runs, since max_cycles never
+	crosses the timer deadline.
+	Returns the number of cycles executed.
+*/
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define THREADED_COMPUTED_GOTO
+#endif
+
+#ifdef THREADED_COMPUTED_GOTO
+	#define threaded_handler(name) handler_##name:
+	#define threaded_dispatch(h) goto *handlers[ std::to_underlying(h) ];
+#else
+	#define threaded_handler(name) case Handler::name:
+	#define threaded_dispatch(h) switch (h)
+#endif
+
+#define threaded_deliver_interrupt() \
+	if (this->has_interrupt) { \
+		this->deliver_interrupt(); \
+		return ncycles; \
+	}
+
+#define threaded_execute_unfused() \
+	if (instruction.type == InstrType::R) \
+		this->execute_r(instruction); \
+	else \
+		this->execute_i(instruction);
+
+// a superinstruction takes two cycles, and the second instruction must be
+// fetchable, otherwise run only the first one and let the loop fetch the second
+#define threaded_fused_begin(name) \
+	if (ncycles >= max_cycles || (paddr + 1) > this->vmem_paddr_end) [[unlikely]] { \
+		this->fusion_fallback_count[ std::to_underlying(Handler::name) ]++; \
+		threaded_execute_unfused() \
+		continue; \
+	} \
+	this->fusion_count[ std::to_underlying(Handler::name) ]++; \
+	if (this->profiling) [[unlikely]] \
+		this->profile_instruction(paddr + 1, decode(this->pmem_read(paddr + 1))); \
+	ncycles++; \
+	this->pc++;
+
+uint32_t Cpu::run_threaded (const uint32_t max_cycles)
+{
+#ifdef THREADED_COMPUTED_GOTO
+	static void* const handlers[] = {
+		&&handler_Add,
+		&&handler_Sub,
+		&&handler_Mul,
+		&&handler_Div,
+		&&handler_Cmp_equal,
+		&&handler_Cmp_neq,
+		&&handler_Load,
+		&&handler_Store,
+		&&handler_Syscall,
+		&&handler_Jump,
+		&&handler_Jump_cond,
+		&&handler_Mov,
+		&&handler_Cmp_equal_jump_cond,
+		&&handler_Cmp_neq_jump_cond,
+		&&handler_Mov_load,
+		&&handler_Mov_store,
+		&&handler_Invalid
+		};
+
+	static_assert(std::size(handlers) == std::to_underlying(Handler::Count));
+#endif
+
+	uint32_t ncycles = 0;
+
+	// pending interrupts are delivered by run_cycle, and the machine skips the cycles of a halted cpu
+	if (this->has_interrupt || this->halted)
+		return 0;
+
+	while (ncycles < max_cycles) {
+		uint16_t paddr = 0; // silences a false maybe-uninitialized warning
+
+		ncycles++;
+
+		if (!this->fetch_address(paddr)) [[unlikely]] {
+			threaded_deliver_interrupt()
+		}
+
+		const DecodedInstruction instruction = this->fetch(paddr);
+
+		if (this->profiling) [[unlikely]]
+			this->profile_instruction(paddr, instruction);
+
+		this->pc++;
+
+		threaded_dispatch(instruction.handler) {
+			threaded_handler(Add)
+				this->gprs[instruction.dest] = this->gprs[instruction.op1] + this->gprs[instruction.op2];
+				continue;
+
+			threaded_handler(Sub)
+				this->gprs[instruction.dest] = this->gprs[instruction.op1] - this->gprs[instruction.op2];
+				continue;
+
+			threaded_handler(Mul)
+				this->gprs[instruction.dest] = this->gprs[instruction.op1] * this->gprs[instruction.op2];
+				continue;
+
+			threaded_handler(Div)
+				this->gprs[instruction.dest] = this->gprs[instruction.op1] / this->gprs[instruction.op2];
+				continue;
+
+			threaded_handler(Cmp_equal)
+				this->gprs[instruction.dest] = (this->gprs[instruction.op1] == this->gprs[instruction.op2]);
+				continue;
+
+			threaded_handler(Cmp_neq)
+				this->gprs[instruction.dest] = (this->gprs[instruction.op1] != this->gprs[instruction.op2]);
+				continue;
+
+			threaded_handler(Load) {
+				const uint16_t value = this->vmem_read( this->gprs[instruction.op1] );
+				threaded_deliver_interrupt()
+				this->gprs[instruction.dest] = value;
+				continue;
+			}
+
+			threaded_handler(Store)
+				this->vmem_write(this->gprs[instruction.op1], this->gprs[instruction.op2]);
+				threaded_deliver_interrupt()
+				continue;
+
+			threaded_handler(Syscall)
+				#ifdef CPU_DEBUG_MODE
+					fake_syscall_handler();
+				#else
+				{
+					const auto lock = this->kernel_lock();
+					OS::syscall();
+				}
+				#endif
+				threaded_deliver_interrupt()
+				if (!this->machine.is_alive() || this->halted)
+					return ncycles;
+				continue;
+
+			threaded_handler(Jump)
+				this->pc = instruction.imed;
+				continue;
+
+			threaded_handler(Jump_cond)
+				if (this->gprs[instruction.dest] == 1)
+					this->pc = instruction.imed;
+				continue;
+
+			threaded_handler(Mov)
+				this->gprs[instruction.dest] = instruction.imed;
+				continue;
+
+			threaded_handler(Cmp_equal_jump_cond)
+				threaded_fused_begin(Cmp_equal_jump_cond)
+				this->gprs[instruction.dest] = (this->gprs[instruction.op1] == this->gprs[instruction.op2]);
+				if (this->gprs[instruction.dest] == 1)
+					this->pc = instruction.imed;
+				continue;
+
+			threaded_handler(Cmp_neq_jump_cond)
+				threaded_fused_begin(Cmp_neq_jump_cond)
+				this->gprs[instruction.dest] = (this->gprs[instruction.op1] != this->gprs[instruction.op2]);
+				if (this->gprs[instruction.dest] == 1)
+					this->pc = instruction.imed;
+				continue;
+
+			threaded_handler(Mov_load)
+				threaded_fused_begin(Mov_load)
+				this->gprs[instruction.dest] = instruction.imed;
+				{
+					const uint16_t value = this->vmem_read(instruction.imed);
+					threaded_deliver_interrupt()
+					this->gprs[instruction.op2] = value;
+				}
+				continue;
+
+			threaded_handler(Mov_store)
+				threaded_fused_begin(Mov_store)
+				this->gprs[instruction.dest] = instruction.imed;
+				this->vmem_write(instruction.imed, this->gprs[instruction.op2]);
+				threaded_deliver_interrupt()
+				continue;
+
+			threaded_handler(Invalid)
+				// raises the unknown opcode exception
+				threaded_execute_unfused()
+				continue;
+		}
 	}
+
+	return ncycles;
 }
 
+#undef threaded_handler
+#undef threaded_dispatch
+#undef threaded_deliver_interrupt
+#undef threaded_execute_unfused
+#undef threaded_fused_begin
+
 void Cpu::dump () const
 {
 	terminal_print(Arch, "gprs:")
@@ -478,41 +1603,399 @@ void Cpu::dump () const
 
 // ---------------------------------------
 
-void init ()
+// snapshots store the memory by pages
+static_assert((Config::memsize_words % Config::page_size_words) == 0);
+
+Machine::Machine (const uint32_t ncores)
+	: ncores(ncores)
 {
+	mylib_assert_exception_msg(ncores >= 1 && ncores <= Config::max_cores, "number of cores must be between 1 and ", Config::max_cores)
+
 #ifndef CPU_DEBUG_MODE
-	terminal = new Terminal;
+	this->terminal = new Terminal;
+	this->terminal->set_shared(ncores > 1);
+
+	this->terminal->println(Terminal::Type::Arch, "teste arch 123456789123456789123456789123456789123456789123456789");
+	this->terminal->println(Terminal::Type::Kernel, "teste kernel");
+	this->terminal->println(Terminal::Type::Command, "teste command");
+	this->terminal->println(Terminal::Type::App, "teste app");
 #endif
 
-	terminal_println(Arch, "teste arch 123456789123456789123456789123456789123456789123456789");
-	terminal_println(Kernel, "teste kernel");
-	terminal_println(Command, "teste command");
-	terminal_println(App, "teste app");
+	this->cpus.fill(nullptr);
 
-	cpu = new Cpu;
+	for (uint32_t i = 0; i < ncores; i++) {
+		this->cores[i].cpu = new Cpu(*this, i);
+		this->cpus[i] = this->cores[i].cpu;
+	}
 }
 
-void run_cycle ()
+void Machine::save_state (Lib::WordWriter& out, const bool incremental) const
 {
-	terminal_println(Arch, "starting cycle " << cycle);
+	out.put(this->ncores);
+
+	for (uint32_t i = 0; i < this->ncores; i++) {
+		const Core& core = this->cores[i];
+
+		out.put32(core.timer.get_count());
+		out.put64(core.get_cycle());
+		core.cpu->save_state(out);
+	}
+
+	// bitmap of the pages stored, then those pages:
+	// those not all zero in a full snapshot, the dirty ones in an incremental one
+	const uint16_t *data = this->memory.get_raw();
+	std::array<uint16_t, (Memory::npages + 15) / 16> bitmap = {};
+
+	for (uint32_t page = 0; page < Memory::npages; page++) {
+		const uint16_t *words = data + (page * Config::page_size_words);
+		const bool stored = incremental
+			? this->memory.is_dirty(page)
+			: std::any_of(words, words + Config::page_size_words, [] (const uint16_t w) { return w != 0; });
+
+		if (stored)
+			bitmap[page / 16] |= 1 << (page % 16);
+	}
+
+	out.put_words(bitmap);
+
+	for (uint32_t page = 0; page < Memory::npages; page++) {
+		if (bitmap[page / 16] & (1 << (page % 16)))
+			out.put_words(std::span<const uint16_t>(data + (page * Config::page_size_words), Config::page_size_words));
+	}
+}
+
+void Machine::restore_state (Lib::WordReader& in, const bool incremental)
+{
+	const uint16_t ncores = in.get();
+
+	mylib_assert_exception_msg(ncores == this->ncores, "snapshot of a machine with ", ncores, " cores, this one has ", this->ncores)
+
+	for (uint32_t i = 0; i < this->ncores; i++) {
+		Core& core = this->cores[i];
+
+		core.timer.set_count(in.get32());
+		core.cycle = in.get64();
+		core.cpu->restore_state(in);
+	}
+
+	const std::span<const uint16_t> bitmap = in.get_words((Memory::npages + 15) / 16);
+	uint16_t *data = this->memory.get_raw();
+	static constexpr std::array<uint16_t, Config::page_size_words> zero_page = {};
+
+	// pages already holding the saved contents keep their decoded instructions,
+	// so resuming on a fresh machine only touches the pages in the snapshot
+	// pages left out are zero in a full snapshot and unchanged in an incremental one
+	for (uint32_t page = 0; page < Memory::npages; page++) {
+		const uint16_t paddr = page * Config::page_size_words;
+		const bool stored = bitmap[page / 16] & (1 << (page % 16));
+
+		if (!stored && incremental)
+			continue;
+
+		const std::span<const uint16_t> saved = stored ? in.get_words(Config::page_size_words) : std::span<const uint16_t>(zero_page);
+
+		if (!std::equal(saved.begin(), saved.end(), data + paddr)) {
+			std::copy(saved.begin(), saved.end(), data + paddr);
+
+			for (Cpu *cpu: this->get_cpus())
+				cpu->invalidate_decode_cache(paddr, Config::page_size_words);
+		}
+	}
+}
+
+Machine::~Machine ()
+{
+	// the kernel points to the cpus and the terminal
+	this->kernel.reset();
+
+	for (Core& core: this->cores)
+		delete core.cpu;
+
+	delete this->terminal;
+}
+
+void Machine::run_cycle ()
+{
+	Core& core = this->cores[0];
+
+	trace_println("starting cycle " << core.get_cycle());
 
 #ifndef CPU_DEBUG_MODE
-	terminal->run_cycle();
-	timer.run_cycle();
+	if (this->replay != nullptr) [[unlikely]]
+		this->replay_events();
+	else {
+		const bool typed = this->terminal->run_cycle();
+		const bool ticked = core.timer.run_cycle(*core.cpu);
+
+		// at most one of them, the other interrupt is refused while this one is pending
+		if (this->recording != nullptr) [[unlikely]] {
+			if (typed)
+				this->recording->push({ core.get_cycle(), InterruptCode::Keyboard, static_cast<uint16_t>(this->terminal->get_typed_char()) });
+			else if (ticked)
+				this->recording->push({ core.get_cycle(), InterruptCode::Timer, 0 });
+		}
+	}
 #endif
-	cpu->run_cycle();
+	core.cpu->run_cycle();
 
 #ifdef CPU_DEBUG_MODE
 //	getchar();
 #endif
 
-	cycle++;
+	core.advance(1);
+}
+
+void Machine::start_recording (const std::string_view fname)
+{
+	mylib_assert_exception_msg(this->ncores == 1, "recording needs a machine with a single core")
+
+	this->recording = std::make_unique<EventLog>(this->cores[0].get_cycle());
+	this->recording_fname = fname;
+}
+
+void Machine::stop_recording ()
+{
+	if (this->recording == nullptr)
+		return;
+
+	// stopped even if writing fails, so it is not retried on exit
+	const std::unique_ptr<EventLog> recording = std::move(this->recording);
+
+	recording->write_file(this->recording_fname, this->cores[0].get_cycle());
+}
+
+uint64_t Machine::start_replay (const std::string_view fname)
+{
+	mylib_assert_exception_msg(this->ncores == 1, "replay needs a machine with a single core")
+
+	auto replay = std::make_unique<EventLog>(fname);
+
+	mylib_assert_exception_msg(replay->get_start_cycle() == this->cores[0].get_cycle(), fname, " was recorded from cycle ", replay->get_start_cycle(), ", the machine is at cycle ", this->cores[0].get_cycle())
+
+	const uint64_t end_cycle = replay->get_end_cycle();
+
+	this->replay = std::move(replay);
+	this->terminal->set_keyboard(false);
+
+	return end_cycle;
+}
+
+// raises the interrupt of the event due on this cycle, if any, where run_cycle would raise
+// the keyboard and timer ones; after the last event, the keyboard and the timer take over
+void Machine::replay_events ()
+{
+	Core& core = this->cores[0];
+	const uint64_t cycle = core.get_cycle();
+	const EventLog::Event *event = this->replay->peek();
+	const bool due = (event != nullptr) && (event->cycle == cycle);
+
+	mylib_assert_exception_msg(event == nullptr || event->cycle >= cycle, "replay passed the event of cycle ", event->cycle, " at cycle ", cycle)
+
+	if (due && event->code == InterruptCode::Keyboard)
+		this->terminal->type_char(event->key);
+
+	bool raised = this->terminal->run_cycle();
+
+	if (due && event->code == InterruptCode::Timer) {
+		raised = core.cpu->interrupt(InterruptCode::Timer);
+		core.timer.set_count(0);
+	}
+	else
+		core.timer.count_cycle();
+
+	mylib_assert_exception_msg(raised == due, "replay diverged from the recording at cycle ", cycle)
+
+	if (due) {
+		this->replay->pop();
+
+		if (this->replay->peek() == nullptr) {
+			this->replay.reset();
+			this->terminal->set_keyboard(true);
+		}
+	}
+}
+
+// the core is halted until the next interrupt (see Cpu::halt), so the cycles up to the next
+// timer interrupt or replayed event pass at once; with a single core and a keyboard,
+// the simulator first waits for a key, so an idle machine leaves the host cpu idle too
+void Machine::run_halted (Core& core, const uint64_t max_cycles)
+{
+	const uint64_t ncycles = std::min(this->get_cycles_to_event(core), max_cycles - core.get_cycle());
+
+	if (ncycles == 0)
+		return;
+
+#if !defined(CONFIG_HEADLESS) && !defined(CPU_DEBUG_MODE)
+	// the host sleeps instead of spinning, core 0 reads the keyboard meanwhile,
+	// a key typed is raised by the next run_cycle, on this same cycle
+	// the other cores only get work at their timer interrupt, they sleep until then
+	if (this->terminal->has_keyboard()) {
+		if (&core == &this->cores[0]) {
+			if (this->terminal->wait_char(std::chrono::milliseconds(Config::idle_wait_ms)))
+				return;
+		}
+		else {
+			std::unique_lock<std::mutex> lock(this->idle_mutex);
+			this->idle_cv.wait_for(lock, std::chrono::milliseconds(Config::idle_wait_ms), [this] () { return !this->alive; });
+		}
+	}
+#endif
+
+	core.timer.advance(ncycles);
+	core.advance(ncycles);
+	core.cpu->account_halted_cycles(ncycles);
+}
+
+// multi-core: runs one core on the calling thread
+// core 0 also polls the terminal, every Config::terminal_flush_check_cycles
+void Machine::run_core (const uint32_t id, const uint64_t max_cycles)
+{
+	Core& core = this->cores[id];
+	uint64_t next_poll = 0;
+
+	Arch::machine = this;
+	core_id = id;
+
+	while (this->alive && core.get_cycle() < max_cycles) {
+	#ifndef CPU_DEBUG_MODE
+		if (id == 0 && core.get_cycle() >= next_poll) {
+			this->terminal->run_cycle();
+		#ifndef CONFIG_HEADLESS
+			this->terminal->flush_if_due();
+		#endif
+			next_poll = core.get_cycle() + Config::terminal_flush_check_cycles;
+		}
+
+		core.timer.run_cycle(*core.cpu);
+	#endif
+
+		core.cpu->run_cycle();
+		core.advance(1);
+
+		if (core.cpu->is_halted()) [[unlikely]]
+			this->run_halted(core, max_cycles);
+		else if (engine == Engine::Threaded && this->alive && !core.cpu->is_tracing()) {
+			const uint32_t ncycles = core.cpu->run_threaded( std::min<uint64_t>(this->get_cycles_to_event(core), max_cycles - core.get_cycle()) );
+			core.timer.advance(ncycles);
+			core.advance(ncycles);
+		}
+	}
+}
+
+void Machine::run (const uint64_t max_cycles)
+{
+	Arch::machine = this;
+
+	if (this->ncores > 1) {
+		std::vector<std::thread> threads;
+
+		for (uint32_t i = 1; i < this->ncores; i++)
+			threads.emplace_back(&Machine::run_core, this, i, max_cycles);
+
+		this->run_core(0, max_cycles);
+
+		for (std::thread& thread: threads)
+			thread.join();
+	}
+	else {
+		Core& core = this->cores[0];
+		Cpu *cpu = core.cpu;
+
+	#if !defined(CPU_DEBUG_MODE) && !defined(CONFIG_HEADLESS)
+		uint64_t next_flush_check = 0;
+	#endif
+
+		while (this->alive && core.get_cycle() < max_cycles) {
+			this->run_cycle();
+
+			if (cpu->is_halted()) [[unlikely]]
+				this->run_halted(core, max_cycles);
+			else if (engine == Engine::Threaded && this->alive && !cpu->is_tracing()) {
+				const uint32_t ncycles = cpu->run_threaded( std::min<uint64_t>(this->get_cycles_to_event(core), max_cycles - core.get_cycle()) );
+				core.timer.advance(ncycles);
+				core.advance(ncycles);
+			}
+
+		#if !defined(CPU_DEBUG_MODE) && !defined(CONFIG_HEADLESS)
+			if (core.get_cycle() >= next_flush_check) {
+				this->terminal->flush_if_due();
+				next_flush_check = core.get_cycle() + Config::terminal_flush_check_cycles;
+			}
+		#endif
+		}
+	}
+
+#ifndef CPU_DEBUG_MODE
+	this->terminal->flush();
+#endif
+}
+
+// ---------------------------------------
+
+Machine* get_machine ()
+{
+	return machine;
+}
+
+void set_machine (Machine *machine)
+{
+	Arch::machine = machine;
+}
+
+void init (const uint32_t ncores)
+{
+	// init may be called again to start a fresh machine
+	if (machine == owned_machine.get())
+		machine = nullptr;
+
+	owned_machine.reset();
+	owned_machine = std::make_unique<Machine>(ncores);
+	machine = owned_machine.get();
+}
+
+void run (const uint64_t max_cycles)
+{
+	machine->run(max_cycles);
+}
+
+void set_engine (const Engine engine)
+{
+	Arch::engine = engine;
+}
+
+Terminal* get_terminal ()
+{
+	return machine->get_terminal();
+}
+
+Cpu* get_cpu (const uint32_t core)
+{
+	return machine->get_cpu(core);
+}
+
+std::span<Cpu* const> get_cpus ()
+{
+	return machine->get_cpus();
+}
+
+uint32_t get_ncores ()
+{
+	return machine->get_ncores();
+}
+
+uint32_t get_core_id ()
+{
+	return core_id;
+}
+
+uint64_t get_cycle ()
+{
+	return machine->get_cycle(core_id);
 }
 
-void run ()
+uint64_t get_cycle (const uint32_t core)
 {
-	while (alive)
-		run_cycle();
+	return machine->get_cycle(core);
 }
 
 // ---------------------------------------
@@ -521,27 +2004,409 @@ void run ()
 
 // ---------------------------------------
 
+#ifndef CONFIG_BENCH // bench.cpp has its own main
+
+static void dump_trace (const std::string_view fname = Config::trace_fname)
+{
+	if (Arch::get_machine() == nullptr || !Arch::get_cpu()->is_tracing())
+		return;
+
+	Arch::get_cpu()->dump_trace(fname);
+	std::cout << "trace written to " << fname << std::endl;
+}
+
+static void export_profile (const std::string_view fname = Config::profile_fname)
+{
+	if (Arch::get_machine() == nullptr || !Arch::get_cpu()->is_profiling())
+		return;
+
+	std::ofstream out{std::string(fname)};
+
+	Arch::write_profile_report(Arch::get_cpu()->get_profile(), out, std::numeric_limits<uint32_t>::max());
+	std::cout << "profile written to " << fname << std::endl;
+}
+
+// --record file
+static std::string_view record_fname;
+
+static void save_recording ()
+{
+	if (Arch::get_machine() == nullptr || !Arch::get_machine()->is_recording())
+		return;
+
+	Arch::get_machine()->stop_recording();
+	std::cout << "events recorded to " << record_fname << std::endl;
+}
+
 static void interrupt_handler (int dummy)
 {
 #ifndef CPU_DEBUG_MODE
-	endwin();
+	Arch::terminal_end();
+#endif
+
+	dump_trace();
+	export_profile();
+
+#ifndef CPU_DEBUG_MODE
+	try {
+		save_recording();
+	}
+	catch (const std::exception& e) {
+		std::cout << e.what() << std::endl;
+	}
 #endif
 
 #ifdef CPU_DEBUG_MODE
-	Arch::cpu->dump();
-	Arch::memory.dump(0, 255);
+	Arch::get_cpu()->dump();
+	Arch::get_machine()->get_memory().dump(0, 255);
 #endif
 
 	exit(1);
 }
 
+static void print_cpu_stats (const Arch::Cpu& cpu, const std::string_view prefix)
+{
+	const uint64_t fetches = cpu.get_decode_cache_hits() + cpu.get_decode_cache_misses();
+
+	std::cout << prefix << "decode cache: " << cpu.get_decode_cache_hits() << " hits, " << cpu.get_decode_cache_misses() << " misses";
+	if (fetches > 0)
+		std::cout << " (hit rate " << (100.0 * cpu.get_decode_cache_hits() / fetches) << "%)";
+	std::cout << std::endl;
+
+	if (cpu.get_mmu_mode() == Arch::MmuMode::Paged) {
+		const uint64_t translations = cpu.get_tlb_hits() + cpu.get_tlb_misses();
+
+		std::cout << prefix << "tlb: " << cpu.get_tlb_hits() << " hits, " << cpu.get_tlb_misses() << " misses";
+		if (translations > 0)
+			std::cout << " (hit rate " << (100.0 * cpu.get_tlb_hits() / translations) << "%)";
+		std::cout << ", " << cpu.get_tlb_flushes() << " flushes, " << cpu.get_page_faults() << " page faults" << std::endl;
+	}
+
+	if (cpu.get_halted_cycles() > 0)
+		std::cout << prefix << "halted: " << cpu.get_halted_cycles() << " cycles skipped" << std::endl;
+
+	for (auto h = std::to_underlying(Arch::Handler::Cmp_equal_jump_cond); h < std::to_underlying(Arch::Handler::Invalid); h++) {
+		const Arch::Handler handler = static_cast<Arch::Handler>(h);
+
+		if (cpu.get_fusion_count(handler) || cpu.get_fusion_fallback_count(handler))
+			std::cout << prefix << "fusion " << Arch::Handler_str(handler) << ": " << cpu.get_fusion_count(handler) << " fused, " << cpu.get_fusion_fallback_count(handler) << " unfused" << std::endl;
+	}
+}
+
+static void print_cpu_stats ()
+{
+	const std::span<Arch::Cpu* const> cpus = Arch::get_cpus();
+
+	for (const Arch::Cpu *cpu: cpus)
+		print_cpu_stats(*cpu, (cpus.size() > 1) ? Mylib::build_str_from_stream("core ", cpu->get_core_id(), " ") : "");
+}
+
+static OS::BootOptions boot_options;
+static uint32_t ncores = 1;
+
+static void parse_cores (const std::string_view value)
+{
+	ncores = std::stoul(std::string(value));
+
+	if (ncores < 1 || ncores > Config::max_cores) {
+		printf("the number of cores must be between 1 and %u\n", Config::max_cores);
+		exit(1);
+	}
+}
+
+static void parse_sched (const std::string_view name)
+{
+	if (name == "rr")
+		boot_options.scheduler_policy = Config::SchedulerPolicy::RoundRobin;
+	else if (name == "mlfq")
+		boot_options.scheduler_policy = Config::SchedulerPolicy::MultilevelFeedback;
+	else {
+		printf("unknown scheduler %s\n", name.data());
+		exit(1);
+	}
+}
+
+static void parse_output (const std::string_view name)
+{
+	if (name == "line")
+		boot_options.output_flush = Config::OutputFlush::Line;
+	else if (name == "tick")
+		boot_options.output_flush = Config::OutputFlush::Tick;
+	else if (name == "full")
+		boot_options.output_flush = Config::OutputFlush::Full;
+	else {
+		printf("unknown output flush policy %s\n", name.data());
+		exit(1);
+	}
+}
+
+static void parse_engine (const std::string_view name)
+{
+	if (name == "switch")
+		Arch::set_engine(Arch::Engine::Switch);
+	else if (name == "threaded")
+		Arch::set_engine(Arch::Engine::Threaded);
+	else {
+		printf("unknown engine %s\n", name.data());
+		exit(1);
+	}
+}
+
+#ifdef CONFIG_HEADLESS
+
+// a batch of several programs writes a file per program, fname with the position and the name
+// of the program before the extension (arq-sim-trace-2-prog.bin), so none overwrites another
+// used for the trace and the profile
+static std::string batch_output_fname (const std::string_view fname, const std::string_view program, const uint32_t i, const size_t nprograms)
+{
+	if (nprograms == 1)
+		return std::string(fname);
+
+	const std::filesystem::path path(fname);
+
+	return Mylib::build_str_from_stream(path.stem().string(), "-", i, "-", std::filesystem::path(program).stem().string(), path.extension().string());
+}
+
+// runs each program on a freshly booted machine until it turns the machine off
+static int batch_main (int argc, char **argv)
+{
+	uint64_t max_cycles = std::numeric_limits<uint64_t>::max();
+	bool dump = false;
+	bool trace = false;
+	bool prof = false;
+	uint16_t text_words = 0;
+	uint32_t jobs = 1;
+	std::string_view resume_fname;
+	std::string_view replay_fname;
+	std::vector<std::string_view> programs;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+
+		if (arg == "--max-cycles" && (i+1) < argc)
+			max_cycles = std::stoull(argv[++i]);
+		else if (arg == "--dump")
+			dump = true;
+		else if (arg == "--engine" && (i+1) < argc)
+			parse_engine(argv[++i]);
+		else if (arg == "--sched" && (i+1) < argc)
+			parse_sched(argv[++i]);
+		else if (arg == "--output" && (i+1) < argc)
+			parse_output(argv[++i]);
+		else if (arg == "--cores" && (i+1) < argc)
+			parse_cores(argv[++i]);
+		else if (arg == "--paging")
+			boot_options.paging = true;
+		else if (arg == "--demand-paging")
+			boot_options.demand_paging = true;
+		else if (arg == "--text-words" && (i+1) < argc)
+			text_words = std::stoul(argv[++i]);
+		else if (arg == "--jobs" && (i+1) < argc)
+			jobs = std::max<unsigned long>(std::stoul(argv[++i]), 1);
+		else if (arg == "--resume" && (i+1) < argc)
+			resume_fname = argv[++i];
+		else if (arg == "--record" && (i+1) < argc)
+			record_fname = argv[++i];
+		else if (arg == "--replay" && (i+1) < argc)
+			replay_fname = argv[++i];
+		else if (arg == "--trace")
+			trace = true;
+		else if (arg == "--prof")
+			prof = true;
+		else if (arg == "--decode-trace" && (i+1) < argc) {
+			Arch::decode_trace_file(argv[++i], std::cout);
+			return 0;
+		}
+		else
+			programs.push_back(arg);
+	}
+
+	if (programs.empty() && resume_fname.empty() && replay_fname.empty()) {
+		printf("usage: %s [--max-cycles n] [--engine switch|threaded] [--sched rr|mlfq] [--output line|tick|full] [--cores n] [--jobs n] [--paging] [--demand-paging] [--text-words n] [--trace] [--prof] [--dump] bin_name [bin_name ...]\n", argv[0]);
+		printf("       %s [options] --resume snapshot_file [bin_name ...]\n", argv[0]);
+		printf("       %s [options] [--resume snapshot_file] --record|--replay events_file [bin_name]\n", argv[0]);
+		printf("       %s --decode-trace trace_file\n", argv[0]);
+		return 1;
+	}
+
+	// the events are those of a single run
+	if ((!record_fname.empty() || !replay_fname.empty()) && programs.size() > 1) {
+		printf("--record and --replay run a single program\n");
+		return 1;
+	}
+
+	// SIGINT saves the trace and the profile of the machine of the main thread only,
+	// the other jobs keep running on theirs, so they cannot be read from the handler
+	if ((trace || prof) && jobs > 1 && programs.size() > 1) {
+		printf("--trace and --prof run one job at a time, use --jobs 1\n");
+		return 1;
+	}
+
+	// resuming or replaying with no program runs the snapshot or the booted machine as it is
+	if (programs.empty())
+		programs.push_back("");
+
+	signal(SIGINT, interrupt_handler);
+
+	uint64_t total_cycles = 0;
+	double total_seconds = 0;
+
+	// each program gets a machine of its own, booted or resumed from the snapshot,
+	// up to jobs of them run at the same time
+	// a report is printed at once, so the reports of programs running together do not mix
+	std::mutex report_mutex;
+	std::atomic<uint32_t> next_program = 0;
+
+	const auto worker = [&] () {
+		for (uint32_t i; (i = next_program++) < programs.size(); ) {
+			const std::string_view program = programs[i];
+			const auto machine = std::make_unique<Arch::Machine>(ncores);
+
+			Arch::set_machine(machine.get());
+			machine->get_cpu()->set_trace(trace);
+			machine->get_cpu()->set_profiling(prof);
+
+			if (resume_fname.empty())
+				OS::boot(*machine, boot_options);
+			else
+				OS::resume(*machine, resume_fname);
+
+			if (!program.empty())
+				OS::load_program(program, text_words);
+
+			// a replay stops where the recording did
+			uint64_t run_cycles = max_cycles;
+
+			if (!record_fname.empty())
+				machine->start_recording(record_fname);
+			// the recording may end before the cycle limit
+			bool stops_at_replay_end = false;
+
+			if (!replay_fname.empty()) {
+				const uint64_t end_cycle = machine->start_replay(replay_fname);
+				stops_at_replay_end = (end_cycle <= max_cycles);
+				run_cycles = std::min(run_cycles, end_cycle);
+			}
+
+			// summed over the cores, a resumed machine starts from the cycles of the snapshot
+			const auto sum_cycles = [&machine] () {
+				uint64_t cycles = 0;
+				for (uint32_t core = 0; core < ncores; core++)
+					cycles += machine->get_cycle(core);
+				return cycles;
+			};
+
+			const uint64_t start_cycles = sum_cycles();
+			const auto begin = std::chrono::steady_clock::now();
+
+			machine->run(run_cycles);
+
+			const auto end = std::chrono::steady_clock::now();
+			const double seconds = std::chrono::duration<double>(end - begin).count();
+			const uint64_t cycles = sum_cycles() - start_cycles;
+
+			{
+				const std::lock_guard<std::mutex> lock(report_mutex);
+
+				total_cycles += cycles;
+				total_seconds += seconds;
+
+				if (dump) {
+					machine->get_terminal()->dump(Arch::Terminal::Type::App);
+					machine->get_terminal()->dump(Arch::Terminal::Type::Kernel);
+				}
+
+				// a run with no program is named after what it started from
+				const std::string_view name = !program.empty() ? program : (!resume_fname.empty() ? resume_fname : replay_fname);
+
+				std::cout << name << ": " << cycles << " cycles, " << seconds << " s, " << (cycles / seconds / 1e6) << " MIPS";
+				if (machine->is_alive())
+					std::cout << (stops_at_replay_end ? " (replay ended)" : " (stopped at cycle limit)");
+				std::cout << std::endl;
+
+				print_cpu_stats();
+				dump_trace(batch_output_fname(Config::trace_fname, program, i, programs.size()));
+				export_profile(batch_output_fname(Config::profile_fname, program, i, programs.size()));
+				save_recording();
+			}
+
+			Arch::set_machine(nullptr);
+		}
+	};
+
+	jobs = std::min<uint32_t>(jobs, programs.size());
+
+	const auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+
+	for (uint32_t i = 1; i < jobs; i++)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (std::thread& thread: threads)
+		thread.join();
+
+	// with more than one job, programs overlap, so the total is over the wall time of the batch
+	if (jobs > 1)
+		total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	if (programs.size() > 1)
+		std::cout << "total: " << total_cycles << " cycles, " << total_seconds << " s, " << (total_cycles / total_seconds / 1e6) << " MIPS" << std::endl;
+
+	return 0;
+}
+
+#endif
+
 int main (int argc, char **argv)
 {
+#ifdef CONFIG_HEADLESS
+	return batch_main(argc, argv);
+#else
+
 #ifdef CPU_DEBUG_MODE
 	if (argc != 2) {
 		printf("usage: %s [bin_name]\n", argv[0]);
 		exit(1);
 	}
+#else
+	bool trace = false;
+	bool prof = false;
+	std::string_view resume_fname;
+	std::string_view replay_fname;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+
+		if (arg == "--engine" && (i+1) < argc)
+			parse_engine(argv[++i]);
+		else if (arg == "--sched" && (i+1) < argc)
+			parse_sched(argv[++i]);
+		else if (arg == "--output" && (i+1) < argc)
+			parse_output(argv[++i]);
+		else if (arg == "--cores" && (i+1) < argc)
+			parse_cores(argv[++i]);
+		else if (arg == "--paging")
+			boot_options.paging = true;
+		else if (arg == "--demand-paging")
+			boot_options.demand_paging = true;
+		else if (arg == "--trace")
+			trace = true;
+		else if (arg == "--prof")
+			prof = true;
+		else if (arg == "--resume" && (i+1) < argc)
+			resume_fname = argv[++i];
+		else if (arg == "--record" && (i+1) < argc)
+			record_fname = argv[++i];
+		else if (arg == "--replay" && (i+1) < argc)
+			replay_fname = argv[++i];
+		else {
+			printf("usage: %s [--engine switch|threaded] [--sched rr|mlfq] [--output line|tick|full] [--cores n] [--paging] [--demand-paging] [--trace] [--prof] [--resume snapshot_file] [--record|--replay events_file]\n", argv[0]);
+			exit(1);
+		}
+	}
 #endif
 
 	signal(SIGINT, interrupt_handler);
@@ -552,29 +2417,55 @@ int main (int argc, char **argv)
 	noecho(); // don't print input
 #endif
 
+#ifdef CPU_DEBUG_MODE
 	Arch::init();
+#else
+	Arch::init(ncores);
+#endif
 
 #ifdef CPU_DEBUG_MODE
-	Lib::load_binary_to_memory(argv[1], static_cast<void*>(Arch::memory.get_raw()), Config::memsize_words * sizeof(uint16_t));
-	Arch::cpu->set_pc(1);
+	Lib::load_binary_to_memory(argv[1], static_cast<void*>(Arch::get_machine()->get_memory().get_raw()), Config::memsize_words * sizeof(uint16_t));
+	Arch::get_cpu()->set_pc(1);
 #else
-	OS::boot(Arch::terminal, Arch::cpu);
+	Arch::get_cpu()->set_trace(trace);
+	Arch::get_cpu()->set_profiling(prof);
+
+	if (resume_fname.empty())
+		OS::boot(*Arch::get_machine(), boot_options);
+	else
+		OS::resume(*Arch::get_machine(), resume_fname);
+
+	// the keyboard takes over after the last event replayed
+	if (!record_fname.empty())
+		Arch::get_machine()->start_recording(record_fname);
+	if (!replay_fname.empty())
+		Arch::get_machine()->start_replay(replay_fname);
 #endif
 
 	Arch::run();
 
 #ifdef CPU_DEBUG_MODE
-	Arch::cpu->dump();
-	Arch::memory.dump(0, 255);
+	Arch::get_cpu()->dump();
+	Arch::get_machine()->get_memory().dump(0, 255);
 #endif
 
 #ifndef CPU_DEBUG_MODE
-	endwin();
+	Arch::terminal_end();
 
 	// print kernel msgs
-	Arch::terminal->dump(Arch::Terminal::Type::Kernel);
+	Arch::get_terminal()->dump(Arch::Terminal::Type::Kernel);
 	std::cout << std::endl;
 #endif
 
+	print_cpu_stats();
+	dump_trace();
+	export_profile();
+#ifndef CPU_DEBUG_MODE
+	save_recording();
+#endif
+
 	return 0;
-}
\ No newline at end of file
+#endif
+}
+
+#endif
@@ -3,12 +3,23 @@
 
 #include <array>
 #include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <string>
+#include <memory>
 #include <string_view>
+#include <span>
+#include <ostream>
+#include <limits>
 
 #include <cstdint>
 
-#if defined(CONFIG_TARGET_LINUX)
+#if defined(CONFIG_HEADLESS)
+	// no terminal backend, see Terminal
+#elif defined(CONFIG_TARGET_LINUX)
 	#include <ncurses.h>
 #elif defined(CONFIG_TARGET_WINDOWS)
 	#include <ncurses/ncurses.h>
@@ -32,21 +43,158 @@ enum class InterruptCode : uint16_t
 {
 	Keyboard,
 	Timer,
-	GPF
+	GPF,
+	PageFault  // paged mode, the faulting address is in Cpu::get_fault_vaddr
 };
 
 const char* InterruptCode_str (const InterruptCode code);
 
 // ---------------------------------------
 
+enum class InstrType : uint8_t
+{
+	R = 0,
+	I = 1
+};
+
+enum class OpcodeR : uint8_t
+{
+	Add = 0,
+	Sub = 1,
+	Mul = 2,
+	Div = 3,
+	Cmp_equal = 4,
+	Cmp_neq = 5,
+	Load = 15,
+	Store = 16,
+	Syscall = 63
+};
+
+enum class OpcodeI : uint8_t
+{
+	Jump = 0,
+	Jump_cond = 1,
+	Mov = 3
+};
+
+// entry of the threaded engine handler table
+enum class Handler : uint8_t
+{
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Cmp_equal,
+	Cmp_neq,
+	Load,
+	Store,
+	Syscall,
+	Jump,
+	Jump_cond,
+	Mov,
+
+	// superinstructions, see Cpu::fuse
+	Cmp_equal_jump_cond,
+	Cmp_neq_jump_cond,
+	Mov_load,
+	Mov_store,
+
+	Invalid, // unknown opcode, handled by the switch interpreter
+
+	Count // must be the last one
+};
+
+const char* Handler_str (const Handler handler);
+
+// instruction fields extracted once from the raw word
+// for I-type instructions, dest holds the register operand
+// fused instructions keep the operands of the second instruction in the fields the first one does not use
+struct DecodedInstruction
+{
+	uint16_t raw;
+	uint16_t imed;
+	InstrType type;
+	uint8_t opcode;
+	uint8_t dest;
+	uint8_t op1;
+	uint8_t op2;
+	Handler handler;
+	bool valid;
+};
+
+// ---------------------------------------
+
+// record of the binary trace ring, see Cpu::set_trace
+struct TraceRecord
+{
+	enum class Kind : uint8_t {
+		Instruction,
+		Interrupt
+	};
+
+	static constexpr uint8_t no_reg = 0xFF;
+
+	uint64_t cycle;
+	uint16_t pc;        // virtual pc of the instruction, or pc when the interrupt was delivered
+	uint16_t raw;       // raw instruction, or the InterruptCode
+	Kind kind;
+	uint8_t reg;        // register written by the instruction, or no_reg
+	uint16_t reg_value; // value written to reg
+};
+
+static_assert(sizeof(TraceRecord) == 16);
+
+// writes a trace file as text
+// raises Mylib::Exception in case of error
+void decode_trace_file (const std::string_view fname, std::ostream& out);
+
+std::string disassemble (const uint16_t raw);
+
+// ---------------------------------------
+
+// guest instruction profile, filled while Cpu profiling is on
+struct Profile
+{
+	std::vector<uint64_t> pc_hits;        // by physical address
+	std::array<uint64_t, 64> opcode_r_hits; // by OpcodeR
+	std::array<uint64_t, 4> opcode_i_hits;  // by OpcodeI
+	std::vector<uint64_t> process_cycles; // by process id, see Cpu::set_profile_owner
+	uint64_t loads;
+	uint64_t stores;
+};
+
+// top_n hot pcs and opcodes, per-process cycles and load/store counts
+void write_profile_report (const Profile& profile, std::ostream& out, const uint32_t top_n);
+
+// ---------------------------------------
+
+enum class Engine : uint8_t
+{
+	Switch,   // execute_r/execute_i, one instruction per Arch cycle
+	Threaded  // run_threaded, runs until the next timer deadline
+};
+
+void set_engine (const Engine engine);
+
+// ---------------------------------------
+
 class VideoOutput
 {
 private:
 	using MatrixBuffer = Mylib::Matrix<char, true>;
 
+#ifndef CONFIG_HEADLESS
 	WINDOW *win;
+#endif
 
+	// circular row buffer, logical row 0 is stored at row head
 	MatrixBuffer buffer;
+	uint32_t head;
+
+	// rows changed since the last update
+	std::vector<bool> dirty_rows;
+	bool dirty;
+	bool all_dirty;
 
 	// cursor position in the buffer
 	uint32_t x;
@@ -59,9 +207,33 @@ public:
 	void print (const std::string_view str);
 	void dump () const;
 
+	// push dirty rows to ncurses, the screen is only updated by doupdate()
+	void update ();
+
 private:
 	void roll ();
-	void update ();
+
+	inline char& cell (const uint32_t row, const uint32_t col)
+	{
+		return this->buffer(this->buffer_row(row), col);
+	}
+
+	inline char cell (const uint32_t row, const uint32_t col) const
+	{
+		return this->buffer(this->buffer_row(row), col);
+	}
+
+	inline uint32_t buffer_row (const uint32_t row) const
+	{
+		const uint32_t r = this->head + row;
+		return (r >= this->buffer.get_nrows()) ? (r - this->buffer.get_nrows()) : r;
+	}
+
+	inline void mark_dirty (const uint32_t row)
+	{
+		this->dirty_rows[row] = true;
+		this->dirty = true;
+	}
 };
 
 // ---------------------------------------
@@ -82,12 +254,57 @@ private:
 	std::vector<VideoOutput> videos;
 	int typed_char;
 	bool has_char;
+	bool keyboard = true; // see set_keyboard
+	std::chrono::steady_clock::time_point last_flush;
+
+	// multi-core: every core prints, so output and flushes are serialized
+	bool shared = false;
+	std::mutex mutex;
+
+	// asynchronous rendering, see Config::render_thread
+	// when enabled, the renderer thread owns ncurses and the videos
+
+	struct RenderRecord {
+		Type video;
+		uint8_t len;
+		std::array<char, Config::render_record_chars> text;
+	};
+
+	bool async = false;
+	std::thread renderer;
+	std::atomic<bool> renderer_stop = false;
+	Lib::SpscQueue<RenderRecord, Config::render_queue_size> render_queue;
+	Lib::SpscQueue<int, 64> input_queue;
+
+	// output waiting for queue space (Coalesce)
+	std::array<std::string, std::to_underlying(Type::Count)> render_pending;
+	bool has_render_pending = false;
+
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, render_dropped_chars, 0)
 
 public:
 	Terminal ();
 	~Terminal ();
 
-	void run_cycle ();
+	// returns true if it raised a keyboard interrupt
+	bool run_cycle ();
+
+	// must be turned on before more than one core runs
+	inline void set_shared (const bool shared)
+	{
+		this->shared = shared;
+	}
+
+	// redraw changed rows of all videos
+	// with the renderer thread, it redraws on its own and these do nothing
+	void flush ();
+
+	// flush, at most Config::terminal_max_fps times per second
+	void flush_if_due ();
+
+	// hand all queued output to the renderer, wait for it to draw it and stop it
+	// must be called before endwin and before dumping the videos
+	void stop_renderer ();
 
 	inline int read_typed_char ()
 	{
@@ -95,9 +312,41 @@ public:
 		return this->typed_char;
 	}
 
+	// the pending key, still to be read by the kernel
+	inline int get_typed_char () const
+	{
+		return this->typed_char;
+	}
+
+	// as if c was typed, the next run_cycle raises the interrupt
+	inline void type_char (const int c)
+	{
+		this->has_char = true;
+		this->typed_char = c;
+	}
+
+	// with the keyboard off, keys typed are ignored, only those given to type_char are read
+	inline void set_keyboard (const bool keyboard)
+	{
+		this->keyboard = keyboard;
+	}
+
+	inline bool has_keyboard () const
+	{
+		return this->keyboard;
+	}
+
+	// redraws and blocks until a key is typed, for at most max_wait
+	// returns true if one was, the next run_cycle raises its interrupt
+	bool wait_char (const std::chrono::milliseconds max_wait);
+
 	inline bool is_backspace (const int c)
 	{
+	#ifdef CONFIG_HEADLESS
+		return (c == 8) || (c == 127);
+	#else
 		return (c == KEY_BACKSPACE) || (c == 8) || (c == 127); // || '\b'
+	#endif
 	}
 
 	inline bool is_alpha (const int c)
@@ -117,7 +366,12 @@ public:
 
 	void print_str (const Type video, const std::string_view str)
 	{
-		this->videos[ std::to_underlying(video) ].print(str);
+		if (this->shared) [[unlikely]] {
+			const std::lock_guard<std::mutex> lock(this->mutex);
+			this->print_str_unlocked(video, str);
+		}
+		else
+			this->print_str_unlocked(video, str);
 	}
 
 	template <typename... Types>
@@ -137,15 +391,40 @@ public:
 	{
 		this->videos[ std::to_underlying(video) ].dump();
 	}
+
+private:
+	void print_str_unlocked (const Type video, const std::string_view str)
+	{
+		if (this->async)
+			this->render_push(video, str);
+		else
+			this->videos[ std::to_underlying(video) ].print(str);
+	}
+
+	void redraw ();
+	void redraw_if_due ();
+
+	void render_loop ();
+	void render_push (const Type video, const std::string_view str);
+	uint32_t render_enqueue (const Type video, const std::string_view str);
+	void render_flush_pending ();
 };
 
 // ---------------------------------------
 
 class Memory
 {
+public:
+	static constexpr uint32_t npages = Config::memsize_words / Config::page_size_words;
+
 private:
 	std::array<uint16_t, Config::memsize_words> data;
 
+	// pages written through write or mark_dirty since the last clear_dirty (incremental snapshots),
+	// a byte per page so that tracking a write is a single plain store,
+	// atomic only because the cores of a machine write to it at the same time
+	std::array<std::atomic<uint8_t>, npages> dirty;
+
 public:
 	Memory ();
 	~Memory ();
@@ -155,6 +434,11 @@ public:
 		return this->data.data();
 	}
 
+	inline const uint16_t* get_raw () const
+	{
+		return this->data.data();
+	}
+
 	inline uint16_t operator[] (const uint32_t paddr) const
 	{
 		mylib_assert_exception(paddr < this->data.size())
@@ -167,18 +451,130 @@ public:
 		return this->data[paddr];
 	}
 
+	// stores through operator[] are not tracked
+	inline void write (const uint32_t paddr, const uint16_t value)
+	{
+		mylib_assert_exception(paddr < this->data.size())
+		this->data[paddr] = value;
+		this->dirty[paddr / Config::page_size_words].store(1, std::memory_order_relaxed);
+	}
+
+	void mark_dirty (const uint32_t paddr, const uint32_t nwords);
+	void clear_dirty ();
+
+	inline bool is_dirty (const uint32_t page) const
+	{
+		return this->dirty[page].load(std::memory_order_relaxed) != 0;
+	}
+
 	void dump (const uint16_t init = 0, const uint16_t end = Config::memsize_words-1) const;
 };
 
 // ---------------------------------------
 
+enum class MmuMode : uint8_t
+{
+	BaseLimit,  // vaddr + vmem_paddr_init, bounded by vmem_paddr_end
+	Paged       // page table installed by the kernel, cached in a software tlb
+};
+
+struct PageTableEntry
+{
+	uint16_t frame;  // physical frame number
+	bool present;
+	bool writable;
+};
+
+// ---------------------------------------
+
+class Cpu;
+class Machine;
+
 class Timer
 {
 private:
-	uint32_t count = 0;
+	OO_ENCAPSULATE_SCALAR_INIT(uint32_t, count, 0)
 
 public:
-	void run_cycle ();
+	// returns true if it raised an interrupt
+	bool run_cycle (Cpu& cpu);
+
+	// run_cycle without raising the interrupt, the count stops when it is due
+	inline void count_cycle ()
+	{
+		if (this->count < Config::timer_interrupt_cycles)
+			this->count++;
+	}
+
+	// number of cycles that can run before the timer raises an interrupt
+	inline uint32_t get_cycles_to_interrupt () const
+	{
+		return (this->count >= Config::timer_interrupt_cycles) ? 0 : (Config::timer_interrupt_cycles - this->count);
+	}
+
+	// account cycles executed without calling run_cycle
+	inline void advance (const uint32_t ncycles)
+	{
+		this->count += ncycles;
+	}
+};
+
+// ---------------------------------------
+
+// External events: the keyboard and timer interrupts raised on core 0, with the cycle
+// they were raised on. Replayed at the same cycles, they make a run execute the same
+// instruction stream again, on another build and without a keyboard (see Machine::start_replay).
+// In files, each event takes a word: the kind and the cycles since the previous event,
+// followed by the cycles when they do not fit in 14 bits, and by the key if it is a keyboard one.
+
+class EventLog
+{
+public:
+	struct Event {
+		uint64_t cycle;
+		InterruptCode code; // Keyboard or Timer
+		uint16_t key; // Keyboard only
+	};
+
+private:
+	std::vector<Event> events;
+	uint32_t next = 0; // replay position
+
+	OO_ENCAPSULATE_SCALAR_READONLY(uint64_t, start_cycle)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, end_cycle, 0)
+
+public:
+	EventLog (const uint64_t start_cycle)
+		: start_cycle(start_cycle)
+	{
+	}
+
+	// raises Mylib::Exception in case of error
+	EventLog (const std::string_view fname);
+
+	inline void push (const Event& event)
+	{
+		this->events.push_back(event);
+	}
+
+	// the next event to replay, nullptr after the last one
+	inline const Event* peek () const
+	{
+		return (this->next < this->events.size()) ? &this->events[this->next] : nullptr;
+	}
+
+	inline void pop ()
+	{
+		this->next++;
+	}
+
+	inline uint32_t size () const
+	{
+		return this->events.size();
+	}
+
+	// raises Mylib::Exception in case of error
+	void write_file (const std::string_view fname, const uint64_t end_cycle) const;
 };
 
 // ---------------------------------------
@@ -189,23 +585,73 @@ private:
 	std::array<uint16_t, Config::nregs> gprs;
 	InterruptCode interrupt_code;
 	bool has_interrupt = false;
+	bool halted = false; // see halt
 
 	OO_ENCAPSULATE_SCALAR(uint16_t, pc)
 	OO_ENCAPSULATE_SCALAR_INIT(uint16_t, vmem_paddr_init, 0)
 	OO_ENCAPSULATE_SCALAR_INIT(uint16_t, vmem_paddr_end, Config::memsize_words-1)
+	OO_ENCAPSULATE_SCALAR_INIT(uint16_t, vmem_text_words, 0) // writes below it raise GPF, in both modes
 
 	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint16_t, pmem_size_words, Config::memsize_words)
+	OO_ENCAPSULATE_SCALAR_READONLY(uint32_t, core_id)
+
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, decode_cache_hits, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, decode_cache_misses, 0)
+
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(MmuMode, mmu_mode, MmuMode::BaseLimit)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint16_t, fault_vaddr, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, tlb_hits, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, tlb_misses, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, tlb_flushes, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, page_faults, 0)
+	OO_ENCAPSULATE_SCALAR_INIT_READONLY(uint64_t, halted_cycles, 0) // skipped by the machine
 
 private:
+	Machine& machine;
 	Memory& memory;
 
+	struct TlbEntry {
+		uint16_t vpage;
+		uint16_t frame;
+		bool writable;
+		bool valid;
+	};
+
+	// paged mode, the table is owned by the kernel
+	const PageTableEntry *page_table = nullptr;
+	uint32_t page_table_size = 0;
+	std::array<TlbEntry, Config::tlb_entries> tlb;
+
+	// indexed by physical address, filled lazily on fetch
+	std::array<DecodedInstruction, Config::memsize_words> decode_cache;
+
+	// ranges copied by the other cores, guarded by the kernel lock, see pmem_copy
+	std::vector<std::pair<uint16_t, uint32_t>> pending_invalidations;
+
+	// executed superinstructions, and the times one had to run unfused
+	std::array<uint64_t, std::to_underlying(Handler::Count)> fusion_count;
+	std::array<uint64_t, std::to_underlying(Handler::Count)> fusion_fallback_count;
+
+	// guest profile, allocated when profiling is turned on
+	bool profiling = false;
+	Profile profile;
+	uint16_t profile_owner = 0;
+
+	// binary trace ring, allocated when tracing is turned on
+	bool tracing = false;
+	std::vector<TraceRecord> trace_ring;
+	uint64_t trace_count = 0; // records ever written
+
 public:
-	Cpu ();
+	Cpu (Machine& machine, const uint32_t core_id = 0);
 	~Cpu ();
 
 	void run_cycle ();
+	uint32_t run_threaded (const uint32_t max_cycles);
 	void dump () const;
 
+	static DecodedInstruction decode (const Mylib::BitSet<16> instruction);
+
 	inline uint16_t get_gpr (const uint8_t code) const
 	{
 		mylib_assert_exception(code < this->gprs.size())
@@ -225,23 +671,205 @@ public:
 
 	inline void pmem_write (const uint16_t paddr, const uint16_t value)
 	{
-		this->memory[paddr] = value;
+		this->memory.write(paddr, value);
+		this->decode_cache[paddr].valid = false;
+
+		// the previous instruction may be fused with this one
+		if (paddr > 0)
+			this->decode_cache[paddr - 1].valid = false;
+	}
+
+	// bulk copy to physical memory, invalidating the decoded instructions it overwrites,
+	// on the other cores only when they next enter the kernel, they may be fetching right now
+	// called with the kernel lock held
+	void pmem_copy (const uint16_t paddr, const std::span<const uint16_t> words);
+
+	// locks the kernel, see Machine::kernel_lock, and applies the invalidations queued by pmem_copy
+	std::unique_lock<std::mutex> kernel_lock ();
+
+	// stores only invalidate the decoded instructions of their own core,
+	// the kernel calls this when a process moves to another core
+	void invalidate_decode_cache (const uint16_t paddr, const uint32_t nwords);
+
+	inline uint64_t get_fusion_count (const Handler handler) const
+	{
+		return this->fusion_count[ std::to_underlying(handler) ];
+	}
+
+	inline uint64_t get_fusion_fallback_count (const Handler handler) const
+	{
+		return this->fusion_fallback_count[ std::to_underlying(handler) ];
 	}
 
 	bool interrupt (const InterruptCode interrupt_code);
 	void force_interrupt (const InterruptCode interrupt_code);
 	void turn_off ();
 
+	// no instruction runs until the next interrupt is raised (syscall 6, used by idle),
+	// the machine skips the cycles in between instead of running them one by one
+	inline void halt ()
+	{
+		// a pending interrupt wakes it right away
+		this->halted = !this->has_interrupt;
+	}
+
+	inline bool is_halted () const
+	{
+		return this->halted;
+	}
+
+	inline void account_halted_cycles (const uint64_t ncycles)
+	{
+		this->halted_cycles += ncycles;
+	}
+
+	void set_mmu_mode (const MmuMode mode);
+
+	// paged mode: the table must stay valid while installed
+	// installing a table flushes the tlb
+	void set_page_table (const PageTableEntry *table, const uint32_t npages);
+	void flush_tlb ();
+
+	// snapshots: registers, mmu registers, the pending interrupt and the halt
+	// the page table is not saved, the kernel installs it again after restoring
+	// raises Mylib::Exception in case of error
+	void save_state (Lib::WordWriter& out) const;
+	void restore_state (Lib::WordReader& in);
+
+	// the threaded engine is not used while tracing
+	void set_trace (const bool enabled);
+
+	inline bool is_tracing () const
+	{
+		return this->tracing;
+	}
+
+	// writes the records in the ring, oldest first
+	// raises Mylib::Exception in case of error
+	void dump_trace (const std::string_view fname) const;
+
+	void set_profiling (const bool enabled);
+
+	inline bool is_profiling () const
+	{
+		return this->profiling;
+	}
+
+	inline const Profile& get_profile () const
+	{
+		return this->profile;
+	}
+
+	// cycles executed from now on are attributed to this process id
+	inline void set_profile_owner (const uint16_t id)
+	{
+		this->profile_owner = id;
+	}
+
 private:
-	void execute_r (const Mylib::BitSet<16> instruction);
-	void execute_i (const Mylib::BitSet<16> instruction);
+	void execute_r (const DecodedInstruction instruction);
+	void execute_i (const DecodedInstruction instruction);
 
-	inline uint16_t vmem_read (const uint16_t vaddr)
+	void deliver_interrupt ();
+
+	void trace_instruction (const uint16_t pc, const DecodedInstruction instruction);
+	void trace_interrupt (const InterruptCode interrupt_code);
+
+	void profile_instruction (const uint16_t paddr, const DecodedInstruction instruction);
+
+	inline TraceRecord& trace_next ()
+	{
+		return this->trace_ring[ (this->trace_count++) & (Config::trace_ring_size - 1) ];
+	}
+
+	inline DecodedInstruction fetch (const uint16_t paddr)
+	{
+		DecodedInstruction& instruction = this->decode_cache[paddr];
+
+		if (instruction.valid) [[likely]]
+			this->decode_cache_hits++;
+		else {
+			this->decode_cache_misses++;
+			instruction = decode(this->pmem_read(paddr));
+
+			// never fuse across a page, the next one may be mapped elsewhere
+			if (Config::instruction_fusion && ((paddr + 1) % Config::page_size_words) != 0)
+				fuse(instruction, decode(this->pmem_read(paddr + 1)));
+		}
+
+		return instruction;
+	}
+
+	static void fuse (DecodedInstruction& first, const DecodedInstruction second);
+
+	// paged mode: raises a page fault if vaddr is not mapped,
+	// or a GPF if a write hits a read-only page
+	inline bool translate (const uint16_t vaddr, const bool write, uint16_t& paddr)
 	{
-		const uint16_t paddr = vaddr + this->vmem_paddr_init;
+		const uint16_t vpage = vaddr / Config::page_size_words;
+		TlbEntry& entry = this->tlb[vpage % Config::tlb_entries];
+
+		if (entry.valid && entry.vpage == vpage) [[likely]]
+			this->tlb_hits++;
+		else {
+			this->tlb_misses++;
+
+			if (vpage >= this->page_table_size || !this->page_table[vpage].present) [[unlikely]] {
+				this->fault_vaddr = vaddr;
+				this->page_faults++;
+				this->force_interrupt(InterruptCode::PageFault);
+				return false;
+			}
+
+			const PageTableEntry& pte = this->page_table[vpage];
+			entry = { vpage, pte.frame, pte.writable, true };
+		}
 
-		if (paddr > this->vmem_paddr_end) {
+		// pages of text are read-only, but the last one may be partial
+		if (write && (!entry.writable || vaddr < this->vmem_text_words)) [[unlikely]] {
 			this->force_interrupt(InterruptCode::GPF);
+			return false;
+		}
+
+		paddr = entry.frame * Config::page_size_words + (vaddr % Config::page_size_words);
+
+		return true;
+	}
+
+	// physical address of the instruction at pc, raises GPF or page fault if it cannot be fetched
+	inline bool fetch_address (uint16_t& paddr)
+	{
+		if (this->mmu_mode == MmuMode::BaseLimit) [[likely]] {
+			paddr = this->pc + this->vmem_paddr_init;
+
+			if (paddr > this->vmem_paddr_end) [[unlikely]] {
+				this->force_interrupt(InterruptCode::GPF);
+				return false;
+			}
+
+			return true;
+		}
+
+		return this->translate(this->pc, false, paddr);
+	}
+
+	// A faulting load/store leaves pc at the faulting instruction (pc was already
+	// incremented), so the kernel can resume the process after a page fault.
+
+	inline uint16_t vmem_read (const uint16_t vaddr)
+	{
+		uint16_t paddr;
+
+		if (this->mmu_mode == MmuMode::BaseLimit) [[likely]] {
+			paddr = vaddr + this->vmem_paddr_init;
+
+			if (paddr > this->vmem_paddr_end) {
+				this->force_interrupt(InterruptCode::GPF);
+				return 0;
+			}
+		}
+		else if (!this->translate(vaddr, false, paddr)) {
+			this->pc--;
 			return 0;
 		}
 
@@ -250,10 +878,18 @@ private:
 
 	inline void vmem_write (const uint16_t vaddr, const uint16_t value)
 	{
-		const uint16_t paddr = vaddr + this->vmem_paddr_init;
+		uint16_t paddr;
 
-		if (paddr > this->vmem_paddr_end) {
-			this->force_interrupt(InterruptCode::GPF);
+		if (this->mmu_mode == MmuMode::BaseLimit) [[likely]] {
+			paddr = vaddr + this->vmem_paddr_init;
+
+			if (paddr > this->vmem_paddr_end || vaddr < this->vmem_text_words) {
+				this->force_interrupt(InterruptCode::GPF);
+				return;
+			}
+		}
+		else if (!this->translate(vaddr, true, paddr)) {
+			this->pc--;
 			return;
 		}
 
@@ -263,6 +899,207 @@ private:
 
 // ---------------------------------------
 
+// A whole simulated computer: cores sharing one memory, the terminal, and the state of
+// the kernel running on it. Machines share nothing, so a host process may run any number
+// of them at the same time, each one driven by its own thread(s).
+
+class Machine
+{
+public:
+	// a core is a cpu with its own timer and cycle count, all of them share the memory
+	struct Core {
+		Cpu *cpu = nullptr;
+		Timer timer;
+
+		// written only by the thread running the core, the kernel on other cores reads it
+		std::atomic<uint64_t> cycle = 0;
+
+		inline uint64_t get_cycle () const
+		{
+			return this->cycle.load(std::memory_order_relaxed);
+		}
+
+		inline void advance (const uint64_t ncycles)
+		{
+			this->cycle.store(this->get_cycle() + ncycles, std::memory_order_relaxed);
+		}
+	};
+
+private:
+	Memory memory;
+	Terminal *terminal = nullptr;
+	std::array<Core, Config::max_cores> cores;
+	std::array<Cpu*, Config::max_cores> cpus;
+	std::atomic<bool> alive = true;
+
+	// Big kernel lock: with more than one core, the kernel runs on one core at a time.
+	// Guest code keeps running on the other cores meanwhile.
+	std::mutex kernel_mutex;
+
+	// halted cores other than core 0 sleep on it, turn_off wakes them, see run_halted
+	std::mutex idle_mutex;
+	std::condition_variable idle_cv;
+
+	// state of the kernel running on the machine, see OS::boot
+	std::shared_ptr<void> kernel;
+
+	// record and replay of the external events of core 0
+	std::unique_ptr<EventLog> recording;
+	std::string recording_fname;
+	std::unique_ptr<EventLog> replay;
+
+	OO_ENCAPSULATE_SCALAR_READONLY(uint32_t, ncores)
+
+public:
+	// raises Mylib::Exception in case of error
+	Machine (const uint32_t ncores = 1);
+	~Machine ();
+
+	// runs until the machine is turned off or every core reaches max_cycles
+	// with more than one core, each core runs on its own host thread (core 0 on the calling one),
+	// and interrupts and syscalls are delivered to the kernel one at a time
+	// the calling thread becomes the one of the machine, see set_machine
+	void run (const uint64_t max_cycles = std::numeric_limits<uint64_t>::max());
+
+	// core 0 only
+	void run_cycle ();
+
+	// locks the kernel if there is more than one core
+	std::unique_lock<std::mutex> kernel_lock ();
+
+	// records the keyboard and timer interrupts from now on, stop_recording writes them to fname
+	// only machines with a single core, the cores of the others interleave differently on every run
+	// raises Mylib::Exception in case of error
+	void start_recording (const std::string_view fname);
+	void stop_recording ();
+
+	inline bool is_recording () const
+	{
+		return this->recording != nullptr;
+	}
+
+	// from now on, the keyboard is ignored and the interrupts are raised by the events recorded
+	// in fname, up to the last one; the machine must be in the state the recording started from,
+	// same programs, boot options and snapshot; returns the cycle the recording ended on
+	// only machines with a single core
+	// raises Mylib::Exception in case of error, or when the run no longer matches the recording
+	uint64_t start_replay (const std::string_view fname);
+
+	inline bool is_replaying () const
+	{
+		return this->replay != nullptr;
+	}
+
+	// snapshots (see OS::save_snapshot): the memory and the cpu, timer and cycle count of every core
+	// a full snapshot leaves zero pages out, an incremental one keeps only the pages
+	// dirty in the memory and is restored on top of the state it was taken from
+	// restoring requires a machine with as many cores
+	// raises Mylib::Exception in case of error
+	void save_state (Lib::WordWriter& out, const bool incremental = false) const;
+	void restore_state (Lib::WordReader& in, const bool incremental = false);
+
+	inline Memory& get_memory ()
+	{
+		return this->memory;
+	}
+
+	inline Terminal* get_terminal () const
+	{
+		return this->terminal;
+	}
+
+	inline Cpu* get_cpu (const uint32_t core = 0) const
+	{
+		return this->cores[core].cpu;
+	}
+
+	inline std::span<Cpu* const> get_cpus () const
+	{
+		return std::span<Cpu* const>(this->cpus.data(), this->ncores);
+	}
+
+	inline uint64_t get_cycle (const uint32_t core) const
+	{
+		return this->cores[core].get_cycle();
+	}
+
+	inline bool is_alive () const
+	{
+		return this->alive;
+	}
+
+	inline void turn_off ()
+	{
+		this->alive = false;
+
+		// taking the lock orders the notify after the check of alive in a wait
+		{
+			const std::lock_guard<std::mutex> lock(this->idle_mutex);
+		}
+		this->idle_cv.notify_all();
+	}
+
+	inline void* get_kernel () const
+	{
+		return this->kernel.get();
+	}
+
+	inline void set_kernel (std::shared_ptr<void> kernel)
+	{
+		this->kernel = std::move(kernel);
+	}
+
+private:
+	void run_core (const uint32_t id, const uint64_t max_cycles);
+	void run_halted (Core& core, const uint64_t max_cycles);
+	void replay_events ();
+
+	// cycles the core may run before run_cycle has an interrupt to raise
+	inline uint64_t get_cycles_to_event (const Core& core) const
+	{
+		uint64_t ncycles = core.timer.get_cycles_to_interrupt();
+
+		// replays run on core 0 of machines with a single core
+		if (this->replay != nullptr) [[unlikely]] {
+			const EventLog::Event *event = this->replay->peek();
+
+			if (event != nullptr)
+				ncycles = std::min(ncycles, event->cycle - core.get_cycle());
+		}
+
+		return ncycles;
+	}
+};
+
+// ---------------------------------------
+
+// The functions below work on the machine of the calling thread.
+// The threads a machine starts for its cores set it on their own.
+
+Machine* get_machine ();
+void set_machine (Machine *machine);
+
+// starts a fresh machine with ncores cores sharing the memory, owned by Arch, and makes it
+// the one of the calling thread; may be called again to replace it
+// raises Mylib::Exception in case of error
+void init (const uint32_t ncores = 1);
+
+void run (const uint64_t max_cycles = std::numeric_limits<uint64_t>::max());
+
+Terminal* get_terminal ();
+Cpu* get_cpu (const uint32_t core = 0);
+std::span<Cpu* const> get_cpus ();
+uint32_t get_ncores ();
+
+// the core run by the calling thread, 0 outside of the core threads
+uint32_t get_core_id ();
+
+// cycles executed by the core of the calling thread, or by the given core
+uint64_t get_cycle ();
+uint64_t get_cycle (const uint32_t core);
+
+// ---------------------------------------
+
 } // end namespace
 
 #endif
\ No newline at end of file
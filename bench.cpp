@@ -0,0 +1,538 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <span>
+#include <memory>
+
+#include <cstdint>
+#include <cstdio>
+
+#include "config.h"
+#include "lib.h"
+#include "arq-sim.h"
+#include "os.h"
+
+/*
+	Benchmark suite.
+	Every benchmark runs a fixed amount of work nreps times and reports
+	the median and the minimum time per operation.
+	Results are printed as JSON. Benchmark names are stable, so results
+	from different releases can be compared.
+*/
+
+// ---------------------------------------
+
+static constexpr uint32_t nreps = 5;
+
+struct Result
+{
+	std::string name;
+	std::string unit;
+	uint64_t ops;
+	double median;
+	double min;
+};
+
+static std::vector<Result> results;
+
+// ---------------------------------------
+
+// fn runs the benchmark once and returns how many operations it did
+static void measure (const std::string_view name, const std::string_view unit, const std::function<uint64_t ()>& fn)
+{
+	std::vector<double> times;
+	uint64_t ops = 0;
+
+	for (uint32_t i = 0; i < nreps; i++) {
+		const auto begin = std::chrono::steady_clock::now();
+		ops = fn();
+		const auto end = std::chrono::steady_clock::now();
+
+		times.push_back(std::chrono::duration<double, std::nano>(end - begin).count() / ops);
+	}
+
+	std::sort(times.begin(), times.end());
+
+	results.push_back({ std::string(name), std::string(unit), ops, times[nreps / 2], times[0] });
+}
+
+static void print_results ()
+{
+	std::cout << "{" << std::endl;
+	std::cout << "  \"suite\": \"arq-sim-bench\"," << std::endl;
+	std::cout << "  \"version\": 1," << std::endl;
+	std::cout << "  \"repetitions\": " << nreps << "," << std::endl;
+	std::cout << "  \"results\": [" << std::endl;
+
+	for (uint32_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+
+		std::cout << "    { \"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"ops\": " << r.ops
+			<< ", \"median\": " << r.median << ", \"min\": " << r.min << " }"
+			<< ((i + 1) < results.size() ? "," : "") << std::endl;
+	}
+
+	std::cout << "  ]" << std::endl;
+	std::cout << "}" << std::endl;
+}
+
+// ---------------------------------------
+
+static constexpr uint16_t encode_r (const Arch::OpcodeR opcode, const uint16_t dest, const uint16_t op1, const uint16_t op2)
+{
+	return (std::to_underlying(opcode) << 9) | (dest << 6) | (op1 << 3) | op2;
+}
+
+static constexpr uint16_t encode_i (const Arch::OpcodeI opcode, const uint16_t reg, const uint16_t imed)
+{
+	return (1 << 15) | (std::to_underlying(opcode) << 13) | (reg << 10) | imed;
+}
+
+static std::string write_program (const std::string_view name, std::vector<uint16_t> code, const uint32_t size_words)
+{
+	const std::string fname = (std::filesystem::temp_directory_path() / name).string();
+
+	code.resize(std::max<std::size_t>(code.size(), size_words), 0);
+
+	FILE *fp = fopen(fname.c_str(), "wb");
+
+	mylib_assert_exception_msg(fp != nullptr, "cannot write file ", fname)
+
+	fwrite(code.data(), sizeof(uint16_t), code.size(), fp);
+	fclose(fp);
+
+	return fname;
+}
+
+// ---------------------------------------
+
+// guest kernels, the program starts at pc 1 and turns the machine off when done
+
+static std::vector<uint16_t> kernel_alu ()
+{
+	using enum Arch::OpcodeR;
+	using enum Arch::OpcodeI;
+
+	return {
+		0,
+		encode_i(Mov, 7, 1),           // 1
+		encode_i(Mov, 6, 500),         // 2
+		encode_i(Mov, 5, 0),           // 3
+		encode_i(Mov, 1, 0),           // 4: outer loop
+		encode_r(Add, 2, 2, 7),        // 5: inner loop
+		encode_r(Mul, 3, 2, 7),        // 6
+		encode_r(Sub, 4, 3, 7),        // 7
+		encode_r(Add, 1, 1, 7),        // 8
+		encode_r(Cmp_neq, 0, 1, 6),    // 9
+		encode_i(Jump_cond, 0, 5),     // 10
+		encode_r(Add, 5, 5, 7),        // 11
+		encode_r(Cmp_neq, 0, 5, 6),    // 12
+		encode_i(Jump_cond, 0, 4),     // 13
+		encode_i(Mov, 0, 0),           // 14
+		encode_r(Syscall, 0, 0, 0)     // 15
+		};
+}
+
+static std::vector<uint16_t> kernel_memory ()
+{
+	using enum Arch::OpcodeR;
+	using enum Arch::OpcodeI;
+
+	return {
+		0,
+		encode_i(Mov, 7, 1),           // 1
+		encode_i(Mov, 6, 500),         // 2
+		encode_i(Mov, 5, 0),           // 3
+		encode_i(Mov, 1, 100),         // 4: outer loop, data at 100..149
+		encode_i(Mov, 2, 150),         // 5
+		encode_r(Store, 0, 1, 5),      // 6: inner loop
+		encode_r(Load, 3, 1, 0),       // 7
+		encode_r(Add, 1, 1, 7),        // 8
+		encode_r(Cmp_neq, 0, 1, 2),    // 9
+		encode_i(Jump_cond, 0, 6),     // 10
+		encode_r(Add, 5, 5, 7),        // 11
+		encode_r(Cmp_neq, 0, 5, 6),    // 12
+		encode_i(Jump_cond, 0, 4),     // 13
+		encode_i(Mov, 0, 0),           // 14
+		encode_r(Syscall, 0, 0, 0)     // 15
+		};
+}
+
+static std::vector<uint16_t> kernel_branch ()
+{
+	using enum Arch::OpcodeR;
+	using enum Arch::OpcodeI;
+
+	return {
+		0,
+		encode_i(Mov, 7, 1),           // 1
+		encode_i(Mov, 6, 500),         // 2
+		encode_i(Mov, 5, 0),           // 3
+		encode_i(Mov, 1, 0),           // 4: outer loop
+		encode_i(Jump, 0, 6),          // 5: inner loop
+		encode_r(Add, 1, 1, 7),        // 6
+		encode_r(Cmp_equal, 0, 1, 6),  // 7
+		encode_i(Jump_cond, 0, 10),    // 8
+		encode_i(Jump, 0, 5),          // 9
+		encode_r(Add, 5, 5, 7),        // 10
+		encode_r(Cmp_neq, 0, 5, 6),    // 11
+		encode_i(Jump_cond, 0, 4),     // 12
+		encode_i(Mov, 0, 0),           // 13
+		encode_r(Syscall, 0, 0, 0)     // 14
+		};
+}
+
+static void bench_interpreter ()
+{
+	struct Kernel {
+		const char *name;
+		std::vector<uint16_t> code;
+	};
+
+	const Kernel kernels[] = {
+		{ "alu", kernel_alu() },
+		{ "memory", kernel_memory() },
+		{ "branch", kernel_branch() }
+		};
+
+	const std::pair<const char*, Arch::Engine> engines[] = {
+		{ "switch", Arch::Engine::Switch },
+		{ "threaded", Arch::Engine::Threaded }
+		};
+
+	for (const Kernel& kernel : kernels) {
+		const std::string fname = write_program(Mylib::build_str_from_stream("arq-sim-bench-", kernel.name, ".bin"), kernel.code, 200);
+
+		for (const auto& [engine_name, engine] : engines) {
+			Arch::set_engine(engine);
+
+			// same workload with base+limit and paged translation
+			for (const bool paging : { false, true }) {
+				OS::BootOptions options;
+				options.paging = paging;
+
+				measure(Mylib::build_str_from_stream("interp.", engine_name, ".", kernel.name, paging ? ".paged" : ""), "ns/cycle", [&fname, &options] () -> uint64_t {
+					Arch::init();
+					OS::boot(*Arch::get_machine(), options);
+					OS::load_program(fname);
+					Arch::run();
+					return Arch::get_cycle();
+				});
+			}
+		}
+
+		std::filesystem::remove(fname);
+	}
+
+	Arch::set_engine(Arch::Engine::Switch);
+}
+
+// ---------------------------------------
+
+static void bench_renderer ()
+{
+	constexpr uint32_t nlines = 100000;
+	const std::string line = "[kernel] process 42 scheduled, pc = 0x0123, gprs: 1 2 3 4 5 6 7 8\n";
+
+	Arch::VideoOutput video(0, 80, 0, 40);
+
+	measure("video.print.line", "ns/line", [&] () -> uint64_t {
+		for (uint32_t i = 0; i < nlines; i++)
+			video.print(line);
+		return nlines;
+	});
+
+	// one char per print, as syscall 1 does
+	measure("video.print.char", "ns/char", [&] () -> uint64_t {
+		for (uint32_t i = 0; i < nlines; i++)
+			video.print(std::string_view(&line[i % line.size()], 1));
+		return nlines;
+	});
+
+	// the pane is full, so every newline scrolls
+	measure("video.roll", "ns/line", [&] () -> uint64_t {
+		for (uint32_t i = 0; i < nlines; i++)
+			video.print("\n");
+		return nlines;
+	});
+
+	// headless build: measures the dirty-row walk, not ncurses
+	measure("video.update", "ns/update", [&] () -> uint64_t {
+		for (uint32_t i = 0; i < nlines; i++) {
+			video.print(line);
+			video.update();
+		}
+		return nlines;
+	});
+}
+
+// ---------------------------------------
+
+static void bench_loader ()
+{
+	constexpr uint32_t nloads = 500;
+
+	const std::string fname = write_program("arq-sim-bench-load.bin", {}, Config::memsize_words / 2);
+
+	measure("load.disk_to_buffer.16k_words", "ns/load", [&fname] () -> uint64_t {
+		for (uint32_t i = 0; i < nloads; i++) {
+			const std::vector<uint16_t> buffer = Lib::load_from_disk_to_16bit_buffer(fname);
+			mylib_assert_exception(buffer.size() == Config::memsize_words / 2)
+		}
+		return nloads;
+	});
+
+	// what the kernel does on /load: the mapped image is copied straight to memory
+	std::vector<uint16_t> memory(Config::memsize_words);
+
+	measure("load.image_cache.cold.16k_words", "ns/load", [&fname, &memory] () -> uint64_t {
+		for (uint32_t i = 0; i < nloads; i++) {
+			Lib::ImageCache cache;
+			const std::shared_ptr<const Lib::MappedFile> file = cache.get_file(fname);
+			const std::span<const uint16_t> image = file->words();
+			std::copy(image.begin(), image.end(), memory.begin());
+		}
+		return nloads;
+	});
+
+	Lib::ImageCache cache;
+
+	measure("load.image_cache.warm.16k_words", "ns/load", [&fname, &memory, &cache] () -> uint64_t {
+		for (uint32_t i = 0; i < nloads; i++) {
+			const std::shared_ptr<const Lib::MappedFile> file = cache.get_file(fname);
+			const std::span<const uint16_t> image = file->words();
+			std::copy(image.begin(), image.end(), memory.begin());
+		}
+		return nloads;
+	});
+
+	std::filesystem::remove(fname);
+}
+
+// ---------------------------------------
+
+static void bench_kernel ()
+{
+	constexpr uint32_t nswitches = 1000000;
+
+	const std::string fname = write_program("arq-sim-bench-switch.bin", kernel_alu(), 200);
+
+	Arch::init();
+	OS::boot(*Arch::get_machine());
+
+	// two user processes, so every switch goes through the ready queue
+	OS::load_program(fname);
+	OS::load_program(fname);
+
+	measure("kernel.context_switch", "ns/switch", [] () -> uint64_t {
+		for (uint32_t i = 0; i < nswitches; i++)
+			OS::context_switch();
+		return nswitches;
+	});
+
+	// a 64-character line at word 100, printed through syscall 1 (NUL-terminated) and 5 (address and length)
+	constexpr uint32_t nprints = 100000;
+	constexpr uint16_t str_addr = 100;
+	constexpr uint16_t str_len = 64;
+
+	std::vector<uint16_t> code = kernel_alu();
+	code.resize(str_addr + str_len + 1, 0);
+	for (uint16_t i = 0; i < (str_len - 1); i++)
+		code[str_addr + i] = 'a' + (i % 26);
+	code[str_addr + str_len - 1] = '\n';
+
+	const std::string print_fname = write_program("arq-sim-bench-print.bin", code, 200);
+
+	OS::load_program(print_fname);
+
+	Arch::Cpu *cpu = Arch::get_cpu();
+
+	for (const uint16_t number : { 1, 5 }) {
+		measure(Mylib::build_str_from_stream("kernel.syscall.", (number == 1) ? "print" : "write", ".64_chars"), "ns/call", [cpu, number] () -> uint64_t {
+			for (uint32_t i = 0; i < nprints; i++) {
+				cpu->set_gpr(0, number);
+				cpu->set_gpr(1, str_addr);
+				cpu->set_gpr(2, str_len);
+				OS::syscall();
+			}
+			return nprints;
+		});
+	}
+
+	std::filesystem::remove(fname);
+	std::filesystem::remove(print_fname);
+}
+
+// ---------------------------------------
+
+// Aggregate throughput of 1, 2, 4 and 8 cores, each running for the same number of cycles.
+// More guest processes than cores, so the cores steal work and preempt through the kernel lock.
+static void bench_multicore ()
+{
+	using enum Arch::OpcodeI;
+
+	constexpr uint32_t nprocesses = 8;
+	constexpr uint64_t cycles_per_core = 2000000;
+
+	// kernel_alu, looping forever instead of turning the machine off
+	std::vector<uint16_t> code = kernel_alu();
+	code[14] = encode_i(Jump, 0, 1);
+	code.pop_back();
+
+	const std::string fname = write_program("arq-sim-bench-multicore.bin", code, 200);
+
+	Arch::set_engine(Arch::Engine::Threaded);
+
+	for (const uint32_t ncores : { 1, 2, 4, 8 }) {
+		measure(Mylib::build_str_from_stream("multicore.threaded.", ncores, "_cores"), "ns/cycle", [&fname, ncores] () -> uint64_t {
+			Arch::init(ncores);
+			OS::boot(*Arch::get_machine());
+
+			for (uint32_t i = 0; i < nprocesses; i++)
+				OS::load_program(fname);
+
+			Arch::run(cycles_per_core);
+
+			uint64_t cycles = 0;
+			for (uint32_t i = 0; i < ncores; i++)
+				cycles += Arch::get_cycle(i);
+
+			return cycles;
+		});
+	}
+
+	Arch::set_engine(Arch::Engine::Switch);
+
+	std::filesystem::remove(fname);
+}
+
+// ---------------------------------------
+
+// Starting a machine with 8 programs loaded: booting and loading them, or resuming a snapshot of it.
+static void bench_snapshot ()
+{
+	constexpr uint32_t nprograms = 8;
+	constexpr uint32_t nstarts = 100;
+
+	const std::string fname = write_program("arq-sim-bench-snapshot.bin", kernel_alu(), 2048);
+	const std::string snapshot_fname = (std::filesystem::temp_directory_path() / "arq-sim-bench-snapshot.snap").string();
+
+	const auto boot = [&fname] () {
+		Arch::init();
+		OS::boot(*Arch::get_machine());
+
+		for (uint32_t i = 0; i < nprograms; i++)
+			OS::load_program(fname);
+	};
+
+	measure("snapshot.start.boot_and_load", "ns/start", [&boot] () -> uint64_t {
+		for (uint32_t i = 0; i < nstarts; i++)
+			boot();
+		return nstarts;
+	});
+
+	boot();
+
+	measure("snapshot.save", "ns/save", [&snapshot_fname] () -> uint64_t {
+		for (uint32_t i = 0; i < nstarts; i++)
+			OS::save_snapshot(snapshot_fname);
+		return nstarts;
+	});
+
+	measure("snapshot.start.resume", "ns/start", [&snapshot_fname] () -> uint64_t {
+		for (uint32_t i = 0; i < nstarts; i++) {
+			Arch::init();
+			OS::resume(*Arch::get_machine(), snapshot_fname);
+		}
+		return nstarts;
+	});
+
+	// checkpoints of a running workload, half of the programs store to memory:
+	// size of a full snapshot and of a checkpoint, every checkpoint_cycles cycles
+	std::vector<uint16_t> memory_image = kernel_memory();
+
+	// initialized data after the code, as most of the image of a real program
+	for (uint32_t i = memory_image.size(); i < 2048; i++)
+		memory_image.push_back(i);
+
+	const std::string memory_fname = write_program("arq-sim-bench-snapshot-memory.bin", memory_image, 2048);
+	const std::string checkpoint_fname = snapshot_fname + ".checkpoint";
+	constexpr uint64_t checkpoint_cycles = 20000;
+	std::vector<double> full_sizes, checkpoint_sizes;
+
+	Arch::init();
+	OS::boot(*Arch::get_machine());
+
+	for (uint32_t i = 0; i < nprograms; i++)
+		OS::load_program((i % 2) ? fname : memory_fname);
+
+	OS::save_snapshot(snapshot_fname);
+
+	for (uint32_t i = 0; i < nreps; i++) {
+		Arch::run(Arch::get_cycle() + checkpoint_cycles);
+
+		// the full one would be taken at the same point, the checkpoint then chains on top of it
+		const std::string parent_fname = Mylib::build_str_from_stream(snapshot_fname, ".", i);
+		full_sizes.push_back(OS::save_snapshot(parent_fname));
+
+		Arch::run(Arch::get_cycle() + checkpoint_cycles);
+		checkpoint_sizes.push_back(OS::save_snapshot(checkpoint_fname, true));
+
+		std::filesystem::remove(parent_fname);
+	}
+
+	for (auto [name, sizes] : { std::make_pair("snapshot.size.full", &full_sizes), std::make_pair("snapshot.size.checkpoint", &checkpoint_sizes) }) {
+		std::sort(sizes->begin(), sizes->end());
+		results.push_back({ name, "bytes", 1, (*sizes)[nreps / 2], (*sizes)[0] });
+	}
+
+	std::filesystem::remove(fname);
+	std::filesystem::remove(memory_fname);
+	std::filesystem::remove(snapshot_fname);
+	std::filesystem::remove(checkpoint_fname);
+}
+
+// ---------------------------------------
+
+// cost of the dirty page tracking of snapshot checkpoints on a memory store
+static void bench_memory ()
+{
+	constexpr uint32_t nwrites = 1 << 22;
+
+	const auto memory = std::make_unique<Arch::Memory>();
+
+	measure("memory.write.raw", "ns/write", [&memory] () -> uint64_t {
+		for (uint32_t i = 0; i < nwrites; i++)
+			(*memory)[(i * 7919) % Config::memsize_words] = i;
+		return nwrites;
+	});
+
+	measure("memory.write.tracked", "ns/write", [&memory] () -> uint64_t {
+		for (uint32_t i = 0; i < nwrites; i++)
+			memory->write((i * 7919) % Config::memsize_words, i);
+		return nwrites;
+	});
+}
+
+// ---------------------------------------
+
+int main (int argc, char **argv)
+{
+	bench_interpreter();
+	bench_renderer();
+	bench_loader();
+	bench_kernel();
+	bench_multicore();
+	bench_snapshot();
+	bench_memory();
+
+	print_results();
+
+	return 0;
+}
@@ -2,6 +2,7 @@
 #define __ARQSIM_HEADER_CONFIG_H__
 
 #include <cstdint>
+#include <array>
 
 //#define CPU_DEBUG_MODE
 
@@ -11,8 +12,112 @@ namespace Config {
 
 	inline constexpr uint16_t memsize_words = 1 << 15;
 
+	// words at the start of the memory that are never given to processes
+	inline constexpr uint16_t kernel_reserved_words = 0x1000;
+
+	// program images kept mapped by the kernel, the cache is emptied when full
+	inline constexpr uint32_t image_cache_max_entries = 64;
+
+	// how the kernel picks a free partition for a new process, can be changed with /mem fit
+	enum class MemoryFit {
+		FirstFit, // lowest address that fits
+		BestFit   // smallest free partition that fits
+	};
+
+	inline constexpr MemoryFit memory_fit = MemoryFit::FirstFit;
+
+	// paged mmu instead of base+limit, can be turned on at boot (--paging)
+	inline constexpr bool paging = false;
+
+	// paged mode: private pages are copied from the program file on first touch
+	// instead of at load time (--demand-paging, implies --paging)
+	inline constexpr bool demand_paging = false;
+
+	// words per page (power of 2), and entries of the cpu software tlb (power of 2)
+	inline constexpr uint32_t page_size_words = 256;
+	inline constexpr uint32_t tlb_entries = 16;
+
 	inline constexpr uint32_t timer_interrupt_cycles = 1024;
 
+	// while idle waits for an interrupt, the simulator waits this long for a key (ncurses build)
+	// before skipping to the next timer interrupt
+	inline constexpr uint32_t idle_wait_ms = 10;
+
+	// cores sharing the memory, each one runs on its own host thread (--cores n)
+	inline constexpr uint32_t max_cores = 8;
+
+	// capacity of the kernel process table, including idle (power of 2)
+	inline constexpr uint32_t max_processes = 256;
+
+	// how the kernel picks the next process, can be changed at boot (--sched)
+	enum class SchedulerPolicy {
+		RoundRobin,
+		MultilevelFeedback
+	};
+
+	inline constexpr SchedulerPolicy scheduler_policy = SchedulerPolicy::RoundRobin;
+
+	// round-robin quantum, in timer interrupts
+	inline constexpr uint32_t rr_quantum_ticks = 1;
+
+	// multilevel feedback queue: quantum of each level (level 0 has the highest priority),
+	// and how often (in timer interrupts) every process is boosted back to level 0
+	inline constexpr auto mlfq_quantum_ticks = std::to_array<uint32_t>({ 1, 2, 4, 8 });
+	inline constexpr uint32_t mlfq_boost_ticks = 64;
+
+	// guest output is kept in a per-process kernel buffer and printed tagged with the pid,
+	// buffers are always flushed when full and when the process exits (--output line|tick|full)
+	enum class OutputFlush {
+		Line, // also at every newline and every timer interrupt
+		Tick, // also at every timer interrupt
+		Full  // only when full or at exit
+	};
+
+	inline constexpr OutputFlush output_flush = OutputFlush::Line;
+	inline constexpr uint32_t output_buffer_chars = 256;
+
+	// where /snapshot saves the machine when no file is given
+	inline constexpr const char *snapshot_fname = "arq-sim-snapshot.bin";
+
+	// records in the binary trace ring (power of 2)
+	inline constexpr uint32_t trace_ring_size = 1 << 16;
+
+	// where the trace ring is dumped (/trace dump, SIGINT and exit)
+	inline constexpr const char *trace_fname = "arq-sim-trace.bin";
+
+	// where the guest profile is exported at exit, and how many entries /prof shows
+	inline constexpr const char *profile_fname = "arq-sim-profile.txt";
+	inline constexpr uint32_t profile_top_n = 10;
+
+	// fuse common instruction pairs into superinstructions (threaded engine)
+	inline constexpr bool instruction_fusion = true;
+
+	// terminal redraws are batched and limited to this rate
+	inline constexpr uint32_t terminal_max_fps = 30;
+
+	// how often (in cycles) Arch::run checks whether a redraw is due
+	inline constexpr uint32_t terminal_flush_check_cycles = 4096;
+
+	// terminal output is drawn by a separate thread that owns ncurses
+	inline constexpr bool render_thread = false;
+
+	// what print does when the renderer queue is full
+	enum class RenderBackpressure {
+		Drop,     // output that does not fit is lost
+		Block,    // the simulation waits for the renderer
+		Coalesce  // output is kept aside and queued later, keeping the newest render_coalesce_max_chars
+	};
+
+	inline constexpr RenderBackpressure render_backpressure = RenderBackpressure::Coalesce;
+
+	inline constexpr uint32_t render_queue_size = 4096; // records, power of 2
+	inline constexpr uint32_t render_record_chars = 60;
+	inline constexpr uint32_t render_coalesce_max_chars = 1 << 16;
+
+	// size of the output buffers when running without ncurses (CONFIG_HEADLESS)
+	inline constexpr uint32_t headless_terminal_cols = 240;
+	inline constexpr uint32_t headless_terminal_rows = 64;
+
 }
 
 #endif
\ No newline at end of file
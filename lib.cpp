@@ -1,5 +1,17 @@
 #include <iostream>
+#include <fstream>
 #include <string_view>
+#include <filesystem>
+#include <system_error>
+
+#include <cstdio>
+
+#ifndef CONFIG_TARGET_WINDOWS
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
 
 #include <my-lib/std.h>
 #include <my-lib/macros.h>
@@ -42,47 +54,191 @@ uint32_t get_file_size_words (const std::string_view fname)
 
 // ---------------------------------------
 
-static bool load_from_disk_to_buffer (const std::string_view fname, void *ptr, const uint32_t mem_size_bytes)
+std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fname)
 {
 	FILE *fp;
 	
 	fp = fopen(fname.data(), "rb");
 	
-	if (fp == nullptr)
-		return false;
+	mylib_assert_exception_msg(fp != nullptr, "cannot load file ", fname)
 
 	fseek(fp, 0, SEEK_END);
 	const uint32_t bsize = ftell(fp);
 
-	if (bsize > mem_size_bytes) {
+	if ((bsize & 0x01) != 0) {
 		fclose(fp);
-		return false;
+		throw Mylib::Exception(Mylib::build_str_from_stream("file size of ", fname, " is not even"));
 	}
-	
+
 	rewind(fp);
 
-	if (fread(ptr, 1, bsize, fp) != bsize) {
-		fclose(fp);
-		return false;
-	}
+	std::vector<uint16_t> buffer(bsize / sizeof(uint16_t));
+
+	const bool ok = (fread(buffer.data(), 1, bsize, fp) == bsize);
 
 	fclose(fp);
 
-	return true;
+	mylib_assert_exception_msg(ok, "cannot load file ", fname)
+
+	return buffer;
 }
 
 // ---------------------------------------
 
-std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fname)
+MappedFile::MappedFile (const std::string_view fname)
 {
-	const int32_t file_size_words = Lib::get_file_size_words(fname);
+#ifdef CONFIG_TARGET_WINDOWS
+	this->buffer = load_from_disk_to_16bit_buffer(fname);
+	this->data = this->buffer.data();
+	this->size_words = this->buffer.size();
+#else
+	const std::string path(fname);
+
+	const int fd = open(path.c_str(), O_RDONLY);
 
-	std::vector<uint16_t> buffer(file_size_words);
+	mylib_assert_exception_msg(fd >= 0, "cannot load file ", fname)
 
-	if (!load_from_disk_to_buffer(fname, buffer.data(), file_size_words * sizeof(uint16_t)))
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
 		throw Mylib::Exception(Mylib::build_str_from_stream("cannot load file ", fname));
+	}
 
-	return buffer;
+	if ((st.st_size & 0x01) != 0) {
+		close(fd);
+		throw Mylib::Exception(Mylib::build_str_from_stream("file size of ", fname, " is not even"));
+	}
+
+	this->size_words = st.st_size / sizeof(uint16_t);
+
+	// mmap does not accept empty mappings
+	if (this->size_words > 0) {
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (ptr == MAP_FAILED) {
+			close(fd);
+			throw Mylib::Exception(Mylib::build_str_from_stream("cannot map file ", fname));
+		}
+
+		this->data = static_cast<const uint16_t*>(ptr);
+	}
+
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+#endif
+}
+
+MappedFile::~MappedFile ()
+{
+#ifndef CONFIG_TARGET_WINDOWS
+	if (this->data != nullptr)
+		munmap(const_cast<uint16_t*>(this->data), this->size_words * sizeof(uint16_t));
+#endif
+}
+
+// ---------------------------------------
+
+std::shared_ptr<const MappedFile> ImageCache::get_file (const std::string_view fname)
+{
+	const std::filesystem::path path(fname);
+	std::error_code ec;
+
+	const uint64_t size_bytes = std::filesystem::file_size(path, ec);
+
+	mylib_assert_exception_msg(!ec, "cannot load file ", fname)
+
+	const int64_t mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+
+	mylib_assert_exception_msg(!ec, "cannot load file ", fname)
+
+	const std::lock_guard<std::mutex> lock(this->mutex);
+
+	const auto it = this->entries.find(std::string(fname));
+
+	if (it != this->entries.end() && it->second.size_bytes == size_bytes && it->second.mtime == mtime) {
+		this->hits++;
+		return it->second.file;
+	}
+
+	this->misses++;
+
+	if (this->entries.size() >= Config::image_cache_max_entries)
+		this->entries.clear();
+
+	Entry& entry = this->entries[std::string(fname)];
+
+	entry.file = std::make_shared<const MappedFile>(fname);
+	entry.size_bytes = size_bytes;
+	entry.mtime = mtime;
+
+	return entry.file;
+}
+
+void ImageCache::clear ()
+{
+	const std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->entries.clear();
+}
+
+// ---------------------------------------
+
+void WordWriter::put_str (const std::string_view str)
+{
+	this->put32(str.size());
+
+	for (size_t i = 0; i < str.size(); i += 2) {
+		const uint16_t high = (i + 1 < str.size()) ? static_cast<uint8_t>(str[i + 1]) : 0;
+		this->put(static_cast<uint8_t>(str[i]) | (high << 8));
+	}
+}
+
+void WordWriter::put_words (const std::span<const uint16_t> words)
+{
+	this->buffer.insert(this->buffer.end(), words.begin(), words.end());
+}
+
+void WordWriter::write_file (const std::string_view fname) const
+{
+	std::ofstream out(std::string(fname), std::ios::binary);
+
+	mylib_assert_exception_msg(out, "cannot create file ", fname)
+
+	out.write(reinterpret_cast<const char*>(this->buffer.data()), this->buffer.size() * sizeof(uint16_t));
+
+	mylib_assert_exception_msg(out, "cannot write file ", fname)
+}
+
+// ---------------------------------------
+
+uint16_t WordReader::get ()
+{
+	mylib_assert_exception_msg(this->pos < this->buffer.size(), "word stream truncated at word ", this->pos)
+
+	return this->buffer[this->pos++];
+}
+
+std::string WordReader::get_str ()
+{
+	const uint32_t size = this->get32();
+	const std::span<const uint16_t> words = this->get_words((size + 1) / 2);
+	std::string str(size, '\0');
+
+	for (uint32_t i = 0; i < size; i++)
+		str[i] = static_cast<char>((i & 0x01) ? (words[i / 2] >> 8) : (words[i / 2] & 0xFF));
+
+	return str;
+}
+
+std::span<const uint16_t> WordReader::get_words (const uint32_t n)
+{
+	mylib_assert_exception_msg(n <= (this->buffer.size() - this->pos), "word stream truncated at word ", this->pos)
+
+	const std::span<const uint16_t> words = this->buffer.subspan(this->pos, n);
+	this->pos += n;
+
+	return words;
 }
 
 // ---------------------------------------
@@ -2,7 +2,15 @@
 #define __ARQSIM_HEADER_LIB_H__
 
 #include <sstream>
+#include <string>
+#include <string_view>
 #include <vector>
+#include <array>
+#include <span>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
 
 #include <cstdint>
 
@@ -18,6 +26,202 @@ std::vector<uint16_t> load_from_disk_to_16bit_buffer (const std::string_view fna
 
 // ---------------------------------------
 
+// read-only view of a whole file of 16-bit words, memory-mapped
+// (read into a buffer on Windows)
+class MappedFile
+{
+private:
+	const uint16_t *data = nullptr;
+	uint32_t size_words = 0;
+
+#ifdef CONFIG_TARGET_WINDOWS
+	std::vector<uint16_t> buffer;
+#endif
+
+public:
+	// raises Mylib::Exception in case of error
+	MappedFile (const std::string_view fname);
+	~MappedFile ();
+
+	MappedFile (const MappedFile&) = delete;
+	MappedFile& operator= (const MappedFile&) = delete;
+
+	inline std::span<const uint16_t> words () const
+	{
+		return std::span<const uint16_t>(this->data, this->size_words);
+	}
+};
+
+// ---------------------------------------
+
+// Program images kept mapped, keyed by path, size and modification time.
+// Loading a cached image only stats the file, it is neither opened nor read.
+class ImageCache
+{
+private:
+	struct Entry {
+		uint64_t size_bytes;
+		int64_t mtime;
+		std::shared_ptr<const MappedFile> file;
+	};
+
+	// shared by all machines, see Arch::Machine
+	std::mutex mutex;
+	std::unordered_map<std::string, Entry> entries;
+	std::atomic<uint64_t> hits = 0;
+	std::atomic<uint64_t> misses = 0;
+
+public:
+	// the file stays mapped while the pointer is held, even if the cache drops it
+	// raises Mylib::Exception in case of error
+	std::shared_ptr<const MappedFile> get_file (const std::string_view fname);
+
+	void clear ();
+
+	inline uint64_t get_hits () const
+	{
+		return this->hits;
+	}
+
+	inline uint64_t get_misses () const
+	{
+		return this->misses;
+	}
+};
+
+// ---------------------------------------
+
+// Streams of 16-bit words, like program images, so they can be loaded with MappedFile.
+// Used by snapshots. Wider values are stored low word first.
+
+class WordWriter
+{
+private:
+	std::vector<uint16_t> buffer;
+
+public:
+	inline void put (const uint16_t v)
+	{
+		this->buffer.push_back(v);
+	}
+
+	inline void put32 (const uint32_t v)
+	{
+		this->put(v & 0xFFFF);
+		this->put(v >> 16);
+	}
+
+	inline void put64 (const uint64_t v)
+	{
+		this->put32(v & 0xFFFFFFFF);
+		this->put32(v >> 32);
+	}
+
+	// the length, then two chars per word
+	void put_str (const std::string_view str);
+
+	// stored as they are, the reader must know how many
+	void put_words (const std::span<const uint16_t> words);
+
+	inline std::span<const uint16_t> words () const
+	{
+		return this->buffer;
+	}
+
+	// raises Mylib::Exception in case of error
+	void write_file (const std::string_view fname) const;
+};
+
+// reading past the end raises Mylib::Exception
+class WordReader
+{
+private:
+	std::span<const uint16_t> buffer;
+	uint32_t pos = 0;
+
+public:
+	WordReader (const std::span<const uint16_t> buffer)
+		: buffer(buffer)
+	{
+	}
+
+	uint16_t get ();
+
+	inline uint32_t get32 ()
+	{
+		const uint32_t low = this->get();
+		return low | (static_cast<uint32_t>(this->get()) << 16);
+	}
+
+	inline uint64_t get64 ()
+	{
+		const uint64_t low = this->get32();
+		return low | (static_cast<uint64_t>(this->get32()) << 32);
+	}
+
+	std::string get_str ();
+
+	// points into the buffer, no copy
+	std::span<const uint16_t> get_words (const uint32_t n);
+
+	inline bool at_end () const
+	{
+		return this->pos == this->buffer.size();
+	}
+};
+
+// ---------------------------------------
+
+// lock-free queue for exactly one producer thread and one consumer thread
+template <typename T, uint32_t capacity>
+class SpscQueue
+{
+	static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of 2");
+
+private:
+	std::array<T, capacity> slots;
+
+	// free-running indexes, the slot is index % capacity
+	alignas(64) std::atomic<uint32_t> head = 0; // written by the consumer
+	alignas(64) std::atomic<uint32_t> tail = 0; // written by the producer
+
+public:
+	// returns false if the queue is full
+	bool push (const T& value)
+	{
+		const uint32_t t = this->tail.load(std::memory_order_relaxed);
+
+		if ((t - this->head.load(std::memory_order_acquire)) == capacity)
+			return false;
+
+		this->slots[t % capacity] = value;
+		this->tail.store(t + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// returns false if the queue is empty
+	bool pop (T& value)
+	{
+		const uint32_t h = this->head.load(std::memory_order_relaxed);
+
+		if (h == this->tail.load(std::memory_order_acquire))
+			return false;
+
+		value = this->slots[h % capacity];
+		this->head.store(h + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool empty () const
+	{
+		return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire);
+	}
+};
+
+// ---------------------------------------
+
 }
 
 #endif
\ No newline at end of file
@@ -3,9 +3,19 @@
 #include <string_view>
 #include <cstdint>
 #include <cstdlib>
+#include <cstdio>
 #include <array>
+#include <vector>
+#include <span>
+#include <map>
+#include <list>
+#include <optional>
+#include <memory>
+#include <algorithm>
+#include <iterator>
 #include <thread>
 #include <chrono>
+#include <filesystem>
 
 #include "config.h"
 #include "lib.h"
@@ -16,10 +26,19 @@ namespace OS
 {
   enum ProcessStatus
   {
+    unused, // free slot in the process table
     exec,
     ready
   };
 
+  // Read-only text pages shared by the instances of a program (paged mode)
+  struct SharedText
+  {
+    std::string name;
+    std::vector<uint16_t> frames;
+    uint32_t refs;
+  };
+
   struct Process
   {
     uint16_t id;
@@ -28,41 +47,194 @@ namespace OS
     ProcessStatus status;
     uint16_t pc;                  // Program Counter
     std::array<uint16_t, 8> gprs; // General-purpose registers
-    Process *next;
-    uint16_t base_addr;  // Base address for virtual memory
-    uint16_t limit_addr; // Limit address for virtual memory
+    Process *next;       // ready queue link, or free list link when unused
+    Process *prev;       // ready queue link
+    uint16_t base_addr;  // Base address for virtual memory (0 in paged mode)
+    uint16_t limit_addr; // Limit address for virtual memory (the size in paged mode)
+    std::vector<Arch::PageTableEntry> page_table; // paged mode
+    uint16_t text_words;  // start of the image that is code, write-protected
+    SharedText *text;     // paged mode, shared pages at the start of page_table
+    std::vector<uint16_t> image; // demand paging, copy of the program file taken at load, pages are copied from it
+    uint32_t pages_loaded; // demand paging, pages copied on first touch
+    std::string output;   // guest output not printed yet, at most Config::output_buffer_chars
+    uint8_t level;        // ready queue level (always 0 in round-robin)
+    uint32_t ticks;       // timer interrupts used of the current quantum
+    uint64_t run_cycles;  // cycles spent running
+    uint64_t wait_cycles; // cycles spent ready, waiting for the cpu
+    uint64_t last_cycle;  // when run_cycles/wait_cycles were last updated
+    uint32_t core;        // core whose ready queue holds it, or that is running it
+    uint32_t last_core;   // core it last ran on, Config::max_cores if none
+    bool killed;          // killed while running on another core, destroyed at its next timer interrupt
+  };
+
+  // Fixed-capacity process table, the first slots hold the idle process of each core.
+  // The slot of a pid is pid % max_processes, so lookup is O(1);
+  // a slot's pid advances by max_processes every time it is freed.
+  static_assert((Config::max_processes & (Config::max_processes - 1)) == 0);
+  static_assert(Config::max_processes <= (1 << 16));
+
+  // Intrusive FIFOs of ready processes, one per level, idle is never queued
+  struct ReadyQueue
+  {
+    Process *head;
+    Process *tail;
+  };
+
+  constexpr uint32_t nlevels = Config::mlfq_quantum_ticks.size();
+
+  // Per-core scheduler state. Every core has its own idle process (pid = core number) and
+  // ready queues; a core with nothing ready steals from the core with the most ready processes.
+  struct Core
+  {
+    uint32_t id;
+    Arch::Cpu *cpu;
+    Process *current; // running process
+    Process *idle;
+    std::array<ReadyQueue, nlevels> ready_queues;
+    uint32_t nready;
+    uint64_t ticks;   // timer interrupts of this core
+    uint64_t steals;  // processes taken from other cores
+  };
+
+  // Physical memory manager, processes get contiguous partitions [base_addr, limit_addr).
+  // Free partitions (holes) are kept ordered by address, base -> size.
+  // In paged mode processes get frames instead, from free_frames.
+  static_assert((Config::kernel_reserved_words % Config::page_size_words) == 0);
+
+  // Everything the kernel keeps about one machine. It is created by boot and owned by
+  // the machine, so several machines can run at the same time, each with its own kernel.
+  struct Kernel
+  {
+    Arch::Terminal *t;
+    std::string command_buffer = "";
+
+    std::array<Process, Config::max_processes> process_table;
+    Process *free_list = nullptr;
+    uint32_t nprocesses = 0;
+
+    std::array<Core, Config::max_cores> cores;
+    uint32_t ncores = 1;
+
+    Config::SchedulerPolicy policy = Config::scheduler_policy;
+    uint64_t timer_ticks = 0; // of all cores
+
+    bool paging = Config::paging;
+    bool demand_paging = Config::demand_paging;
+    uint64_t demand_page_ins = 0;
+
+    // Guest output, printed to the App pane in chunks tagged with the pid of the process.
+    // A chunk that continues the line of the previous one is not tagged again.
+    Config::OutputFlush output_flush = Config::output_flush;
+    uint16_t output_last_pid = 0;
+    bool output_line_start = true;
+    uint64_t output_flushes = 0;
+    std::list<SharedText> shared_texts;
+
+    std::vector<uint16_t> free_frames;
+    std::map<uint32_t, uint32_t> mem_holes;
+    Config::MemoryFit mem_fit = Config::memory_fit;
+    uint64_t mem_compactions = 0;
+    uint64_t mem_words_moved = 0;
+    uint64_t mem_alloc_failures = 0;
+
+    // The last snapshot saved or resumed, the next checkpoint is taken on top of it.
+    std::string snapshot_fname = "";
+    uint64_t snapshot_id = 0;
+    uint32_t checkpoints = 0; // since the last full snapshot
   };
 
-  Arch::Terminal *t;
-  Arch::Cpu *c;
-  Process *current_process = nullptr;
-  std::string command_buffer = "";
+  // The kernel of the machine the calling thread runs, the core the kernel is running on,
+  // and its cpu, set on every entry to the kernel.
+  // Arch delivers interrupts and syscalls to the kernel one core at a time.
+  thread_local Kernel *kernel = nullptr;
+  thread_local Core *core = nullptr;
+  thread_local Arch::Cpu *c = nullptr;
+
+  // Snapshots: a header, the machine (Arch::Machine::save_state) and then the kernel.
+  // The header is the magic, the version, the kind and an id (the time it was saved); an incremental
+  // snapshot (checkpoint) adds the id and the absolute path of the one it was taken on top of.
+  // Pointers are stored as process table slots, or positions in shared_texts.
+  constexpr std::array<uint16_t, 4> snapshot_magic = {'A' | ('R' << 8), 'Q' | ('S' << 8), 'N' | ('A' << 8), 'P'}; // "ARQSNAP"
+  constexpr uint16_t snapshot_version = 4;
+  constexpr uint16_t snapshot_full = 0;
+  constexpr uint16_t snapshot_incremental = 1;
+  constexpr uint16_t snapshot_none = UINT16_MAX;
 
+  // kept across boots and shared by all machines, so batch runs of the same program load it once
+  Lib::ImageCache image_cache;
+
+  void kernelEnter();
+  bool isIdle(const Process *p);
+  void processTableInit();
+  Process *processAlloc();
+  void processRelease(Process *p);
+  Process *processLookup(uint16_t pid);
+  void readyEnqueue(Process *p);
+  Process *readyDequeue();
+  void readyRemove(Process *p);
+  uint32_t readyTopLevel(const Core *k);
+  Core *readyBusiest();
+  void processAccount(Process *p);
+  void schedulerTick();
+  void schedulerBoost();
+  void schedulerInteractive(Process *p);
+  void memInit();
+  std::optional<uint16_t> memAlloc(uint32_t size);
+  void memFree(uint32_t base, uint32_t size);
+  void memCompact();
+  void memStatus();
+  bool processAllocMemory(Process *p, std::string_view name, std::span<const uint16_t> image, uint16_t text_words);
+  void processFreeMemory(Process *p);
+  SharedText *sharedTextAcquire(std::string_view name, std::span<const uint16_t> image, uint32_t npages);
+  void sharedTextRelease(SharedText *text);
+  uint16_t processPaddr(const Process *p, uint16_t vaddr);
+  bool processPageIn(Process *p, uint32_t vpage);
+  bool processGather(Process *p, uint16_t vaddr, uint32_t length, bool until_nul, std::string &out);
   void processInit();
-  void processCreate(std::string_view name, uint16_t pc);
+  Process *processCreate(std::string_view name, uint16_t pc, uint16_t text_words);
+  void processLoad(Process *p, std::span<const uint16_t> image);
+  void processDispatch(Process *p);
   void processRun();
   void processStatus();
-  void processDestroy();
+  void processList();
+  void processDestroy(Process *p);
+  void outputWrite(Process *p, std::string_view str);
+  void outputFlush(Process *p);
+  void outputFlushAll();
   void syscall();
   void processSave();
+  void processInvalidate(Process *p);
+  void kernelCreate(Arch::Machine &machine);
+  uint16_t snapshotSlot(const Process *p);
+  Process *snapshotProcess(uint16_t slot);
+  std::string snapshotCheckpointFname();
+  void kernelSave(Lib::WordWriter &out);
+  void kernelRestore(Lib::WordReader &in);
 
-  void boot(Arch::Terminal *terminal, Arch::Cpu *cpu)
+  void boot(Arch::Machine &machine, const BootOptions &options)
   {
-    terminal->println(Arch::Terminal::Type::Command, "Type commands here");
-    terminal->println(Arch::Terminal::Type::App, "Apps output here");
-    terminal->println(Arch::Terminal::Type::Kernel, "Kernel output here");
+    kernelCreate(machine);
 
-    t = terminal;
-    c = cpu;
+    kernel->policy = options.scheduler_policy;
+    kernel->paging = options.paging || options.demand_paging;
+    kernel->demand_paging = options.demand_paging;
+    kernel->output_flush = options.output_flush;
 
-    // Initialize the first process
-    processInit();
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      kernel->cores[i].cpu->set_mmu_mode(kernel->paging ? Arch::MmuMode::Paged : Arch::MmuMode::BaseLimit);
+    }
 
-    // Create a new process
-    processCreate("idle.bin", 0x0001);
+    // Initialize the process table and the idle processes
+    processInit();
 
-    // Execute the process
-    processRun();
+    // Execute idle on every core, core 0 last so the boot continues there
+    for (uint32_t i = kernel->ncores; i-- > 0;)
+    {
+      core = &kernel->cores[i];
+      c = core->cpu;
+      processRun();
+    }
 
     processSave();
 
@@ -79,263 +251,1904 @@ namespace OS
 
   void interrupt(const Arch::InterruptCode interrupt)
   {
-    if (interrupt == Arch::InterruptCode::Keyboard)
+    kernelEnter();
+
+    if (interrupt == Arch::InterruptCode::GPF)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "General Protection Fault no processo " + std::to_string(core->current->id) + ", encerrando.");
+      processDestroy(core->current);
+    }
+    else if (interrupt == Arch::InterruptCode::PageFault)
+    {
+      const uint32_t vpage = c->get_fault_vaddr() / Config::page_size_words;
+
+      if (vpage >= core->current->page_table.size())
+      {
+        kernel->t->println(Arch::Terminal::Type::Kernel, "Page fault no endereço " + std::to_string(c->get_fault_vaddr()) + " do processo " + std::to_string(core->current->id) + ", encerrando.");
+        processDestroy(core->current);
+      }
+      else if (!processPageIn(core->current, vpage)) // the faulting instruction is restarted
+      {
+        kernel->t->println(Arch::Terminal::Type::Kernel, "Sem frames livres para o processo " + std::to_string(core->current->id) + ", encerrando.");
+        processDestroy(core->current);
+      }
+    }
+    else if (interrupt == Arch::InterruptCode::Timer)
+    {
+      if (core->current->killed)
+      {
+        processDestroy(core->current);
+        return;
+      }
+
+      // only the running process writes, so its buffer is the only one that changed
+      if (kernel->output_flush != Config::OutputFlush::Full)
+      {
+        outputFlush(core->current);
+      }
+      schedulerTick();
+    }
+    else if (interrupt == Arch::InterruptCode::Keyboard)
     {
-      int typed = t->read_typed_char();
+      int typed = kernel->t->read_typed_char();
 
       if (typed == '\b')
       {
-        if (command_buffer.empty())
+        if (kernel->command_buffer.empty())
         {
-          command_buffer.pop_back();
-          t->print_str(Arch::Terminal::Type::Command, "\b \b");
+          kernel->command_buffer.pop_back();
+          kernel->t->print_str(Arch::Terminal::Type::Command, "\b \b");
         }
       }
       else
       {
-        command_buffer += typed;
-        t->print_str(Arch::Terminal::Type::Command, std::string(1, typed));
+        kernel->command_buffer += typed;
+        kernel->t->print_str(Arch::Terminal::Type::Command, std::string(1, typed));
       }
 
-      if (t->is_backspace(typed))
+      if (kernel->t->is_backspace(typed))
       {
-        if (command_buffer.empty())
+        if (kernel->command_buffer.empty())
         {
-          command_buffer.pop_back();
-          for (size_t i = 0; i < command_buffer.size() + 1; ++i)
+          kernel->command_buffer.pop_back();
+          for (size_t i = 0; i < kernel->command_buffer.size() + 1; ++i)
           {
-            t->print(Arch::Terminal::Type::Command, '\r');
-            t->print(Arch::Terminal::Type::Command, command_buffer);
+            kernel->t->print(Arch::Terminal::Type::Command, '\r');
+            kernel->t->print(Arch::Terminal::Type::Command, kernel->command_buffer);
           }
-          t->print_str(Arch::Terminal::Type::Command, "\b \b");
+          kernel->t->print_str(Arch::Terminal::Type::Command, "\b \b");
         }
       }
 
       if (typed == '\n')
       {
-        if (command_buffer.rfind("/syscall ", 0) == 0)
+        if (kernel->command_buffer.rfind("/syscall ", 0) == 0)
         {
-          std::string syscall_num_str = command_buffer.substr(9); // Take the syscall number
+          std::string syscall_num_str = kernel->command_buffer.substr(9); // Take the syscall number
           uint16_t syscall_num = std::stoi(syscall_num_str);
 
           c->set_gpr(0, syscall_num);
 
           syscall();
 
-          t->println(Arch::Terminal::Type::App, "Syscall " + std::to_string(syscall_num) + " executed.");
+          kernel->t->println(Arch::Terminal::Type::App, "Syscall " + std::to_string(syscall_num) + " executed.");
         }
-        else if (command_buffer.rfind("/load ", 0) == 0)
+        else if (kernel->command_buffer.rfind("/load ", 0) == 0)
         {
-          size_t space_pos = command_buffer.find(' ');
+          size_t space_pos = kernel->command_buffer.find(' ');
           if (space_pos != std::string::npos)
           {
-            std::string program_name = command_buffer.substr(space_pos + 1);
+            std::string program_name = kernel->command_buffer.substr(space_pos + 1);
             if (!program_name.empty() && program_name.back() == '\n')
             {
               program_name.pop_back();
             }
-            processCreate(program_name, 0x0001);
-            processRun();
-            t->println(Arch::Terminal::Type::Kernel, "Programa " + program_name + " carregado.");
+
+            // optional size of the text: /load prog.bin 200
+            uint16_t text_words = 0;
+            const size_t last_space = program_name.rfind(' ');
+            if (last_space != std::string::npos && last_space + 1 < program_name.size() &&
+                program_name.find_first_not_of("0123456789", last_space + 1) == std::string::npos)
+            {
+              text_words = static_cast<uint16_t>(std::min<unsigned long>(std::stoul(program_name.substr(last_space + 1)), UINT16_MAX));
+              program_name.resize(last_space);
+            }
+
+            const uint64_t misses = image_cache.get_misses();
+            const auto begin = std::chrono::steady_clock::now();
+
+            load_program(program_name, text_words);
+
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+            const bool cold = image_cache.get_misses() != misses;
+
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Programa " + program_name + " carregado em " + std::to_string(elapsed.count()) + " us (" + (cold ? "disco" : "cache") + ").");
+          }
+          else
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Erro: Nome do arquivo não especificado.");
+          }
+        }
+        else if (kernel->command_buffer == "/kill\n") // Kill the running process
+        {
+          if (!isIdle(core->current))
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Killing process " + core->current->name);
+            processDestroy(core->current);
+          }
+          else
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "No process to kill.");
+          }
+        }
+        else if (kernel->command_buffer.rfind("/kill ", 0) == 0) // Kill process by pid
+        {
+          Process *p = nullptr;
+          try
+          {
+            const unsigned long pid = std::stoul(kernel->command_buffer.substr(6));
+            if (pid <= UINT16_MAX)
+            {
+              p = processLookup(static_cast<uint16_t>(pid));
+            }
+          }
+          catch (const std::exception &)
+          {
+          }
+
+          if (p == nullptr)
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Processo inexistente.");
+          }
+          else if (isIdle(p))
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "idle.bin não pode ser encerrado.");
+          }
+          else
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Killing process " + p->name);
+            processDestroy(p);
+          }
+        }
+        else if (kernel->command_buffer == "/ps\n") // List the processes
+        {
+          processList();
+        }
+        else if (kernel->command_buffer == "/mem\n") // Show the free partitions
+        {
+          memStatus();
+        }
+        else if (kernel->command_buffer == "/mem compact\n")
+        {
+          if (kernel->paging)
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Modo paginado, não há o que compactar.");
+          }
+          else if (kernel->ncores > 1)
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, "A compactação move processos, só é possível com um núcleo.");
           }
           else
           {
-            t->println(Arch::Terminal::Type::Kernel, "Erro: Nome do arquivo não especificado.");
+            memCompact();
+            memStatus();
           }
         }
-        else if (command_buffer == "/kill\n") // Kill process
+        else if (kernel->command_buffer == "/mem fit first\n")
+        {
+          kernel->mem_fit = Config::MemoryFit::FirstFit;
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Alocação first-fit.");
+        }
+        else if (kernel->command_buffer == "/mem fit best\n")
+        {
+          kernel->mem_fit = Config::MemoryFit::BestFit;
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Alocação best-fit.");
+        }
+        else if (kernel->command_buffer == "/trace on\n")
+        {
+          c->set_trace(true);
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Trace ligado.");
+        }
+        else if (kernel->command_buffer == "/trace off\n")
+        {
+          c->set_trace(false);
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Trace desligado.");
+        }
+        else if (kernel->command_buffer == "/trace dump\n")
+        {
+          c->dump_trace(Config::trace_fname);
+          kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Trace salvo em ") + Config::trace_fname);
+        }
+        else if (kernel->command_buffer == "/prof on\n")
+        {
+          c->set_profiling(true);
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Profiler ligado.");
+        }
+        else if (kernel->command_buffer == "/prof off\n")
+        {
+          c->set_profiling(false);
+          kernel->t->println(Arch::Terminal::Type::Kernel, "Profiler desligado.");
+        }
+        else if (kernel->command_buffer == "/prof\n") // Show the hottest pcs and opcodes
         {
-          if (current_process != nullptr)
+          if (c->is_profiling())
           {
-            t->println(Arch::Terminal::Type::Kernel, "Killing process " + current_process->name);
-            processDestroy();
+            std::ostringstream report;
+            Arch::write_profile_report(c->get_profile(), report, Config::profile_top_n);
+            kernel->t->print_str(Arch::Terminal::Type::Kernel, report.str());
           }
           else
           {
-            t->println(Arch::Terminal::Type::Kernel, "No process to kill.");
+            kernel->t->println(Arch::Terminal::Type::Kernel, "Profiler desligado, use /prof on.");
+          }
+        }
+        else if (kernel->command_buffer.rfind("/snapshot", 0) == 0 || kernel->command_buffer.rfind("/checkpoint", 0) == 0) // Save the machine: /snapshot [file], /checkpoint [file]
+        {
+          const bool incremental = kernel->command_buffer.rfind("/checkpoint", 0) == 0;
+          std::string fname = kernel->command_buffer.substr(incremental ? 11 : 9);
+          fname.erase(std::remove_if(fname.begin(), fname.end(), [](const char ch) { return ch == ' ' || ch == '\n'; }), fname.end());
+          if (fname.empty())
+          {
+            fname = incremental ? snapshotCheckpointFname() : Config::snapshot_fname;
+          }
+
+          try
+          {
+            const std::string parent = kernel->snapshot_fname;
+            const auto begin = std::chrono::steady_clock::now();
+            const uint64_t bytes = save_snapshot(fname, incremental);
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+
+            if (incremental)
+            {
+              kernel->t->println(Arch::Terminal::Type::Kernel, "Checkpoint salvo em " + fname + " sobre " + parent + " (" + std::to_string(bytes) + " bytes, " + std::to_string(elapsed.count()) + " us).");
+            }
+            else
+            {
+              kernel->t->println(Arch::Terminal::Type::Kernel, "Snapshot salvo em " + fname + " (" + std::to_string(bytes) + " bytes, " + std::to_string(elapsed.count()) + " us).");
+            }
+          }
+          catch (const std::exception &e)
+          {
+            kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Erro ao salvar o snapshot: ") + e.what());
           }
         }
-        else if (command_buffer == "/status\n") // Show process status
+        else if (kernel->command_buffer == "/status\n") // Show process status
         {
-          if (current_process != nullptr)
+          if (core->current != nullptr)
           {
             processStatus();
           }
           else
           {
-            t->println(Arch::Terminal::Type::Kernel, "No process running.");
+            kernel->t->println(Arch::Terminal::Type::Kernel, "No process running.");
           }
         }
         else
         {
-          t->println(Arch::Terminal::Type::App, "Unknown command: " + command_buffer);
+          kernel->t->println(Arch::Terminal::Type::App, "Unknown command: " + kernel->command_buffer);
         }
 
-        command_buffer.clear();
+        kernel->command_buffer.clear();
       }
     }
   }
 
-  void syscall()
+  void resume(Arch::Machine &machine, const std::string_view fname)
   {
-    const uint16_t syscall = c->get_gpr(0);
-    uint16_t strAdr = c->get_gpr(1);
+    // The chain of checkpoints from fname back to its full snapshot, newest first,
+    // each read up to the end of its header
+    std::vector<std::unique_ptr<Lib::MappedFile>> files;
+    std::vector<Lib::WordReader> chain;
+    std::string next(fname);
+    uint64_t id = 0;
+    uint64_t parent_id = 0;
 
-    if (strAdr < current_process->base_addr || strAdr >= current_process->limit_addr)
+    while (true)
     {
-      t->println(Arch::Terminal::Type::Kernel, "General Protection Fault: Acesso de memória inválido.");
-      processDestroy();
-      return;
+      files.push_back(std::make_unique<Lib::MappedFile>(next));
+      Lib::WordReader &in = chain.emplace_back(files.back()->words());
+
+      const std::span<const uint16_t> magic = in.get_words(snapshot_magic.size());
+      const bool valid = std::equal(magic.begin(), magic.end(), snapshot_magic.begin()) && (in.get() == snapshot_version);
+      mylib_assert_exception_msg(valid, next, " is not a snapshot of this version")
+
+      const uint16_t kind = in.get();
+      mylib_assert_exception_msg(kind == snapshot_full || kind == snapshot_incremental, "invalid kind of snapshot in ", next)
+
+      const uint64_t file_id = in.get64();
+      if (chain.size() == 1)
+      {
+        id = file_id;
+      }
+      else
+      {
+        // The file was overwritten after the checkpoint was taken
+        mylib_assert_exception_msg(file_id == parent_id, next, " is not the snapshot the checkpoints after it were taken on top of")
+      }
+
+      if (kind == snapshot_full)
+      {
+        break;
+      }
+
+      parent_id = in.get64();
+      next = in.get_str();
     }
 
-    switch (syscall)
+    // The oldest one first, each checkpoint only has the pages written since the previous one
+    for (size_t i = chain.size(); i-- > 1;)
     {
-    case 0:
-      t->println(Arch::Terminal::Type::Kernel, "Encerrando o sistema...");
-      std::this_thread::sleep_for(std::chrono::seconds(2));
-      c->turn_off();
-      break;
-    case 1:
+      machine.restore_state(chain[i], i < (chain.size() - 1));
+    }
+
+    Lib::WordReader &in = chain.front();
+    machine.restore_state(in, chain.size() > 1);
+
+    kernelCreate(machine);
+    kernelRestore(in);
+
+    mylib_assert_exception_msg(in.at_end(), "trailing data in snapshot ", fname)
+
+    // The next checkpoint is taken on top of this one
+    machine.get_memory().clear_dirty();
+    kernel->snapshot_fname = std::filesystem::absolute(std::filesystem::path(fname)).string();
+    kernel->snapshot_id = id;
+    kernel->checkpoints = chain.size() - 1;
+
+    // The page tables are kernel memory, so they are installed again
+    for (uint32_t i = 0; i < kernel->ncores; i++)
     {
-      while (c->pmem_read(strAdr))
+      const Core &k = kernel->cores[i];
+
+      if (kernel->paging)
       {
-        t->print(Arch::Terminal::Type::App, static_cast<char>(c->pmem_read(strAdr)));
-        strAdr++;
+        k.cpu->set_page_table(k.current->page_table.data(), k.current->page_table.size());
       }
-      break;
+      k.cpu->set_profile_owner(k.current->id);
     }
-    case 2:
-      t->println(Arch::Terminal::Type::App);
-      break;
-    case 3:
-      t->println(Arch::Terminal::Type::App, strAdr);
+
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Snapshot " + std::string(fname) + " restaurado.");
+  }
+
+  uint64_t save_snapshot(const std::string_view fname, const bool incremental)
+  {
+    kernelEnter();
+
+    // guest code keeps running on the other cores while the kernel runs
+    mylib_assert_exception_msg(kernel->ncores == 1, "snapshots need a machine with a single core")
+    mylib_assert_exception_msg(!incremental || !kernel->snapshot_fname.empty(), "a checkpoint needs a snapshot to be taken on top of")
+
+    const std::string path = std::filesystem::absolute(std::filesystem::path(fname)).string();
+
+    // Overwriting a file of the chain would break the checkpoints taken on top of it
+    mylib_assert_exception_msg(!incremental || path != kernel->snapshot_fname, "a checkpoint cannot overwrite the snapshot it is taken on top of")
+
+    Arch::Machine *machine = Arch::get_machine();
+    const uint64_t id = std::chrono::system_clock::now().time_since_epoch().count();
+    Lib::WordWriter out;
+
+    out.put_words(snapshot_magic);
+    out.put(snapshot_version);
+    out.put(incremental ? snapshot_incremental : snapshot_full);
+    out.put64(id);
+    if (incremental)
+    {
+      out.put64(kernel->snapshot_id);
+      out.put_str(kernel->snapshot_fname);
     }
+    machine->save_state(out, incremental);
+    kernelSave(out);
+
+    out.write_file(fname);
+
+    machine->get_memory().clear_dirty();
+    kernel->snapshot_fname = path;
+    kernel->snapshot_id = id;
+    kernel->checkpoints = incremental ? (kernel->checkpoints + 1) : 0;
+
+    return out.words().size_bytes();
   }
 
-  void processInit()
+  // The first fname.N (see Config::snapshot_fname) that does not exist yet
+  std::string snapshotCheckpointFname()
   {
-    uint32_t idle_bin_size = Lib::get_file_size_words("idle.bin");
-    if (idle_bin_size == 0)
+    for (uint32_t n = kernel->checkpoints + 1;; n++)
     {
-      t->println(Arch::Terminal::Type::Kernel, "Erro ao carregar idle.bin");
-      return;
+      const std::string fname = std::string(Config::snapshot_fname) + "." + std::to_string(n);
+      if (!std::filesystem::exists(fname))
+      {
+        return fname;
+      }
     }
+  }
 
-    Process *p = new Process;
-    p->id = 0;
-    p->begin = true;
-    p->name = "idle.bin";
-    p->status = ProcessStatus::exec;
-    p->pc = 0;
-    p->gprs.fill(0);
+  void load_program(const std::string_view fname, const uint16_t text_words)
+  {
+    kernelEnter();
 
-    p->base_addr = 0x1000;
-    p->limit_addr = 0x1000 + idle_bin_size;
+    Process *p = processCreate(fname, 0x0001, text_words);
+    if (p != nullptr)
+    {
+      processDispatch(p);
+    }
+  }
 
-    uint32_t word = Lib::get_file_size_words("idle.bin");
+  void context_switch()
+  {
+    kernelEnter();
 
-    c->pmem_read(word);
-    c->pmem_write(p->base_addr, word);
-    current_process = p;
+    Process *next = readyDequeue();
+    if (next != nullptr)
+    {
+      processDispatch(next);
+    }
   }
 
-  void processCreate(std::string_view name, uint16_t pc)
+  void kernelEnter()
   {
-    Process *p = new Process;
-    p->id = current_process ? current_process->id + 1 : 1;
-    p->begin = false;
-    p->name = name;
-    p->status = ProcessStatus::ready;
-    p->pc = pc;
-    p->gprs.fill(0);
-    p->next = nullptr;
+    kernel = static_cast<Kernel *>(Arch::get_machine()->get_kernel());
+    core = &kernel->cores[Arch::get_core_id()];
+    c = core->cpu;
+  }
+
+  bool isIdle(const Process *p)
+  {
+    return static_cast<uint32_t>(p - kernel->process_table.data()) < kernel->ncores;
+  }
+
+  // Called on every timer interrupt, preempts the running process when its quantum expires
+  void schedulerTick()
+  {
+    kernel->timer_ticks++;
+    core->ticks++;
+
+    if (kernel->policy == Config::SchedulerPolicy::MultilevelFeedback && (core->ticks % Config::mlfq_boost_ticks) == 0)
+    {
+      schedulerBoost();
+    }
 
-    uint32_t program_size = Lib::get_file_size_words(name);
-    if (program_size == 0)
+    Process *p = core->current;
+
+    // idle gives up the cpu as soon as another process is ready, here or on another core
+    if (p == core->idle)
     {
-      t->println(Arch::Terminal::Type::Kernel, std::string("Erro ao carregar ") + std::string(name));
+      context_switch();
       return;
     }
 
-    p->base_addr = 0x2000;
-    p->limit_addr = p->base_addr + program_size;
+    p->ticks++;
 
-    uint16_t word = Lib::get_file_size_words(name);
-    c->pmem_read(word);
-    c->pmem_write(p->base_addr, word);
+    const uint32_t quantum = (kernel->policy == Config::SchedulerPolicy::RoundRobin) ? Config::rr_quantum_ticks : Config::mlfq_quantum_ticks[p->level];
 
-    if (current_process != nullptr)
+    if (p->ticks >= quantum)
     {
-      current_process->next = p;
+      p->ticks = 0;
+      if (kernel->policy == Config::SchedulerPolicy::MultilevelFeedback && p->level < (nlevels - 1))
+      {
+        p->level++;
+      }
+
+      // p keeps the cpu if nobody of the same or higher priority is ready here,
+      // and no other core has work to give away
+      if (readyTopLevel(core) <= p->level || readyBusiest()->nready > core->nready + 1)
+      {
+        context_switch();
+      }
     }
-    else
+    else if (readyTopLevel(core) < p->level)
     {
-      current_process = p;
+      context_switch();
     }
   }
 
-  void processDestroy()
+  // Move every process of this core back to level 0, so cpu-bound processes do not starve
+  void schedulerBoost()
   {
-    Process *p = current_process;
-    if (p->name != "idle.bin" && current_process->next != nullptr)
-    {
-      current_process = current_process->next;
-    }
-    else
+    for (uint32_t level = 1; level < nlevels; level++)
     {
-      processInit();
-      delete p;
+      while (Process *p = core->ready_queues[level].head)
+      {
+        readyRemove(p);
+        p->level = 0;
+        p->ticks = 0;
+        readyEnqueue(p);
+      }
     }
+
+    core->current->level = 0;
+    core->current->ticks = 0;
   }
 
-  void processRun()
+  // Processes doing I/O are treated as interactive and move one level up
+  void schedulerInteractive(Process *p)
   {
-    if (current_process == nullptr)
+    if (kernel->policy == Config::SchedulerPolicy::MultilevelFeedback && p->level > 0)
     {
-      t->println(Arch::Terminal::Type::Kernel, "Nenhum processo em execução, retornando para idle.bin");
-      processInit();
+      p->level--;
     }
+  }
+
+  void syscall()
+  {
+    kernelEnter();
 
-    if (current_process->status == ProcessStatus::exec)
+    const uint16_t syscall = c->get_gpr(0);
+    uint16_t strAdr = c->get_gpr(1);
+
+    switch (syscall)
+    {
+    case 0:
+      outputFlushAll();
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Encerrando o sistema...");
+#ifndef CONFIG_HEADLESS
+      kernel->t->flush(); // show the message before waiting
+      std::this_thread::sleep_for(std::chrono::seconds(2));
+#endif
+      c->turn_off();
+      break;
+    case 1:
+    case 5:
     {
-      c->set_pc(current_process->pc);
-      for (uint8_t i = 0; i < current_process->gprs.size(); ++i)
+      schedulerInteractive(core->current);
+
+      // syscall 1 prints the NUL-terminated string at r1, syscall 5 writes the r2 words at r1
+      // both are virtual addresses of the calling process, checked once for the whole range
+      const uint32_t size = core->current->limit_addr - core->current->base_addr;
+      const bool until_nul = (syscall == 1);
+      const uint32_t length = until_nul ? size - std::min<uint32_t>(strAdr, size) : c->get_gpr(2);
+
+      if (strAdr >= size || (strAdr + length) > size)
       {
-        c->set_gpr(i, current_process->gprs[i]);
+        kernel->t->println(Arch::Terminal::Type::Kernel, "General Protection Fault: Acesso de memória inválido.");
+        processDestroy(core->current);
+        return;
       }
+
+      std::string str;
+      if (!processGather(core->current, strAdr, length, until_nul, str))
+      {
+        kernel->t->println(Arch::Terminal::Type::Kernel, "Sem frames livres para o processo " + std::to_string(core->current->id) + ", encerrando.");
+        processDestroy(core->current);
+        return;
+      }
+
+      outputWrite(core->current, str);
+      break;
     }
-    else if (current_process->status == ProcessStatus::ready)
-    {
-      processSave();
-      current_process = current_process->next ? current_process->next : current_process;
-      current_process->status = ProcessStatus::exec;
-      processRun();
+    case 2:
+      schedulerInteractive(core->current);
+      outputWrite(core->current, "\n");
+      break;
+    case 3:
+      schedulerInteractive(core->current);
+      outputWrite(core->current, std::to_string(strAdr) + '\n');
+      break;
+    case 4: // exit
+      if (!isIdle(core->current))
+      {
+        processDestroy(core->current);
+      }
+      break;
+    case 6: // wait for the next interrupt, idle waits instead of spinning
+      c->halt();
+      break;
     }
   }
 
-  void processSave()
+  void processTableInit()
   {
-    current_process->pc = c->get_pc();
-    for (uint8_t i = 0; i < current_process->gprs.size(); ++i)
+    kernel->free_list = nullptr;
+    kernel->nprocesses = 0;
+
+    for (Core &k : kernel->cores)
     {
-      current_process->gprs[i] = c->get_gpr(i);
+      k.current = nullptr;
+      k.idle = nullptr;
+      k.ready_queues.fill(ReadyQueue{nullptr, nullptr});
+      k.nready = 0;
+      k.ticks = 0;
+      k.steals = 0;
     }
-  }
 
-  void processStatus()
-  {
-    if (current_process->status == ProcessStatus::exec)
+    // slots are pushed backwards so the lowest pids come out first
+    for (uint32_t i = Config::max_processes; i-- > 0;)
     {
-      t->println(Arch::Terminal::Type::Kernel, "Process " + current_process->name + " is running");
+      Process *p = &kernel->process_table[i];
+      p->id = static_cast<uint16_t>(i);
+      p->status = ProcessStatus::unused;
+      p->name.clear();
+      p->page_table.clear();
+      p->text = nullptr;
+      p->image.clear();
+      p->output.clear();
+      p->next = nullptr;
+      p->prev = nullptr;
+
+      if (!isIdle(p))
+      {
+        p->next = kernel->free_list;
+        kernel->free_list = p;
+      }
     }
-    else if (current_process->status == ProcessStatus::ready)
+  }
+
+  Process *processAlloc()
+  {
+    Process *p = kernel->free_list;
+    if (p != nullptr)
     {
-      t->println(Arch::Terminal::Type::Kernel, "Process " + current_process->name + " is ready");
+      kernel->free_list = p->next;
+      p->next = nullptr;
+      p->prev = nullptr;
+      kernel->nprocesses++;
     }
+    return p;
+  }
 
-    t->println(Arch::Terminal::Type::Kernel, "Base Address: 0x" + std::to_string(current_process->base_addr));
-    t->println(Arch::Terminal::Type::Kernel, "Limit Address: 0x" + std::to_string(current_process->limit_addr));
-    t->println(Arch::Terminal::Type::Kernel, "Program Counter: 0x" + std::to_string(current_process->pc));
-    t->println(Arch::Terminal::Type::Kernel, "General Purpose Registers: " + std::to_string(current_process->gprs.size()));
+  void processRelease(Process *p)
+  {
+    p->status = ProcessStatus::unused;
+    p->name.clear();
+    p->image.clear();
+    p->id += Config::max_processes; // keeps the slot, invalidates the old pid
+    p->next = kernel->free_list;
+    p->prev = nullptr;
+    kernel->free_list = p;
+    kernel->nprocesses--;
+  }
+
+  Process *processLookup(uint16_t pid)
+  {
+    Process *p = &kernel->process_table[pid % Config::max_processes];
+    return (p->status != ProcessStatus::unused && p->id == pid) ? p : nullptr;
+  }
+
+  void readyEnqueue(Process *p)
+  {
+    Core &k = kernel->cores[p->core];
+    ReadyQueue &queue = k.ready_queues[p->level];
+
+    p->next = nullptr;
+    p->prev = queue.tail;
+    if (queue.tail != nullptr)
+    {
+      queue.tail->next = p;
+    }
+    else
+    {
+      queue.head = p;
+    }
+    queue.tail = p;
+    k.nready++;
+  }
+
+  // First process of the highest-priority non-empty level of this core.
+  // With nothing ready here, or at least two ready processes less than the busiest core,
+  // the first one of the busiest core is stolen.
+  Process *readyDequeue()
+  {
+    const Core *from = core;
+    const Core *busiest = readyBusiest();
+
+    if (core->nready == 0 || busiest->nready > core->nready + 1)
+    {
+      from = busiest;
+      if (from->nready == 0)
+      {
+        return nullptr;
+      }
+      core->steals++;
+    }
+
+    Process *p = from->ready_queues[readyTopLevel(from)].head;
+    readyRemove(p);
+
+    // from now on p is timed with the clock of this core
+    if (from != core)
+    {
+      processAccount(p);
+      p->core = core->id;
+      p->last_cycle = Arch::get_cycle();
+    }
+
+    return p;
+  }
+
+  void readyRemove(Process *p)
+  {
+    Core &k = kernel->cores[p->core];
+    ReadyQueue &queue = k.ready_queues[p->level];
+
+    if (p->prev != nullptr)
+    {
+      p->prev->next = p->next;
+    }
+    else
+    {
+      queue.head = p->next;
+    }
+
+    if (p->next != nullptr)
+    {
+      p->next->prev = p->prev;
+    }
+    else
+    {
+      queue.tail = p->prev;
+    }
+
+    p->next = nullptr;
+    p->prev = nullptr;
+    k.nready--;
+  }
+
+  // Core with the most ready processes
+  Core *readyBusiest()
+  {
+    return &*std::max_element(kernel->cores.begin(), kernel->cores.begin() + kernel->ncores, [](const Core &a, const Core &b) { return a.nready < b.nready; });
+  }
+
+  // Highest-priority level of core k with a ready process, nlevels if there is none
+  uint32_t readyTopLevel(const Core *k)
+  {
+    uint32_t level = 0;
+    while (level < nlevels && k->ready_queues[level].head == nullptr)
+    {
+      level++;
+    }
+    return level;
+  }
+
+  void memInit()
+  {
+    kernel->mem_holes.clear();
+    kernel->mem_holes[Config::kernel_reserved_words] = Config::memsize_words - Config::kernel_reserved_words;
+
+    // pushed backwards so the lowest frames are used first
+    kernel->free_frames.clear();
+    kernel->shared_texts.clear();
+    kernel->demand_page_ins = 0;
+    for (uint32_t frame = Config::memsize_words / Config::page_size_words; frame-- > Config::kernel_reserved_words / Config::page_size_words;)
+    {
+      kernel->free_frames.push_back(static_cast<uint16_t>(frame));
+    }
+
+    kernel->mem_compactions = 0;
+    kernel->mem_words_moved = 0;
+    kernel->mem_alloc_failures = 0;
+  }
+
+  // Find a partition of size words, compacting the memory if the free space
+  // is large enough but fragmented
+  std::optional<uint16_t> memAlloc(uint32_t size)
+  {
+    auto chosen = kernel->mem_holes.end();
+
+    for (auto it = kernel->mem_holes.begin(); it != kernel->mem_holes.end(); ++it)
+    {
+      if (it->second < size)
+      {
+        continue;
+      }
+
+      if (chosen == kernel->mem_holes.end() || it->second < chosen->second)
+      {
+        chosen = it;
+      }
+
+      if (kernel->mem_fit == Config::MemoryFit::FirstFit || it->second == size)
+      {
+        break;
+      }
+    }
+
+    if (chosen == kernel->mem_holes.end())
+    {
+      uint32_t free_words = 0;
+      for (const auto &[base, hole_size] : kernel->mem_holes)
+      {
+        free_words += hole_size;
+      }
+
+      // compaction moves processes, which other cores may be running
+      if (free_words < size || kernel->ncores > 1)
+      {
+        kernel->mem_alloc_failures++;
+        return std::nullopt;
+      }
+
+      memCompact(); // leaves a single hole
+      chosen = kernel->mem_holes.begin();
+    }
+
+    const uint32_t base = chosen->first;
+    const uint32_t remaining = chosen->second - size;
+
+    kernel->mem_holes.erase(chosen);
+    if (remaining > 0)
+    {
+      kernel->mem_holes[base + size] = remaining;
+    }
+
+    return base;
+  }
+
+  // Return a partition, merging it with the adjacent holes
+  void memFree(uint32_t base, uint32_t size)
+  {
+    auto next = kernel->mem_holes.lower_bound(base);
+
+    if (next != kernel->mem_holes.end() && (base + size) == next->first)
+    {
+      size += next->second;
+      next = kernel->mem_holes.erase(next);
+    }
+
+    if (next != kernel->mem_holes.begin())
+    {
+      auto prev = std::prev(next);
+      if ((prev->first + prev->second) == base)
+      {
+        prev->second += size;
+        return;
+      }
+    }
+
+    kernel->mem_holes.emplace_hint(next, base, size);
+  }
+
+  // Slide every partition down to the start of the memory, so all free space becomes one hole.
+  // Moving down in address order never overwrites a partition that was not copied yet.
+  void memCompact()
+  {
+    // frames need no compaction
+    if (kernel->paging)
+    {
+      return;
+    }
+
+    std::vector<Process *> resident;
+    for (Process &p : kernel->process_table)
+    {
+      if (p.status != ProcessStatus::unused)
+      {
+        resident.push_back(&p);
+      }
+    }
+
+    std::sort(resident.begin(), resident.end(), [](const Process *a, const Process *b) { return a->base_addr < b->base_addr; });
+
+    uint32_t next_base = Config::kernel_reserved_words;
+
+    for (Process *p : resident)
+    {
+      const uint32_t size = p->limit_addr - p->base_addr;
+
+      if (p->base_addr != next_base)
+      {
+        for (uint32_t i = 0; i < size; ++i)
+        {
+          c->pmem_write(next_base + i, c->pmem_read(p->base_addr + i));
+        }
+
+        kernel->mem_words_moved += size;
+        p->base_addr = next_base;
+        p->limit_addr = next_base + size;
+
+        if (p == core->current)
+        {
+          c->set_vmem_paddr_init(p->base_addr);
+          c->set_vmem_paddr_end(p->limit_addr - 1);
+        }
+      }
+
+      next_base += size;
+    }
+
+    kernel->mem_holes.clear();
+    if (next_base < Config::memsize_words)
+    {
+      kernel->mem_holes[next_base] = Config::memsize_words - next_base;
+    }
+
+    kernel->mem_compactions++;
+  }
+
+  void memStatus()
+  {
+    if (kernel->paging)
+    {
+      const uint32_t nframes = (Config::memsize_words - Config::kernel_reserved_words) / Config::page_size_words;
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Modo paginado: " + std::to_string(kernel->free_frames.size()) + "/" + std::to_string(nframes) + " frames livres de " + std::to_string(Config::page_size_words) + " palavras");
+      kernel->t->println(Arch::Terminal::Type::Kernel, "TLB: " + std::to_string(c->get_tlb_hits()) + " hits, " + std::to_string(c->get_tlb_misses()) + " misses, " + std::to_string(c->get_tlb_flushes()) + " flushes, " + std::to_string(c->get_page_faults()) + " page faults");
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Falhas de alocação: " + std::to_string(kernel->mem_alloc_failures));
+
+      uint32_t saved = 0;
+      for (const SharedText &text : kernel->shared_texts)
+      {
+        saved += text.frames.size() * (text.refs - 1);
+        kernel->t->println(Arch::Terminal::Type::Kernel, "  texto compartilhado " + text.name + ": " + std::to_string(text.frames.size()) + " frames, " + std::to_string(text.refs) + " processos");
+      }
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Frames economizados com texto compartilhado: " + std::to_string(saved));
+
+      if (kernel->demand_paging)
+      {
+        // resident versus mapped pages of the live processes
+        uint32_t resident = 0;
+        uint32_t mapped = 0;
+        for (const Process &p : kernel->process_table)
+        {
+          if (p.status == ProcessStatus::unused)
+          {
+            continue;
+          }
+
+          mapped += p.page_table.size();
+          for (const Arch::PageTableEntry &pte : p.page_table)
+          {
+            resident += pte.present;
+          }
+        }
+
+        kernel->t->println(Arch::Terminal::Type::Kernel, "Paginação sob demanda: " + std::to_string(kernel->demand_page_ins) + " páginas carregadas, " + std::to_string(resident) + " de " + std::to_string(mapped) + " páginas residentes");
+      }
+      return;
+    }
+
+    uint32_t free_words = 0;
+    uint32_t largest = 0;
+    for (const auto &[base, size] : kernel->mem_holes)
+    {
+      free_words += size;
+      largest = std::max(largest, size);
+    }
+
+    // external fragmentation: share of the free memory outside the largest hole
+    const uint32_t fragmentation = free_words ? (100 * (free_words - largest) / free_words) : 0;
+
+    kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Memória livre: ") + std::to_string(free_words) + " palavras em " + std::to_string(kernel->mem_holes.size()) + " partições, maior " + std::to_string(largest));
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Fragmentação externa: " + std::to_string(fragmentation) + "%, " + ((kernel->mem_fit == Config::MemoryFit::FirstFit) ? "first-fit" : "best-fit"));
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Compactações: " + std::to_string(kernel->mem_compactions) + " (" + std::to_string(kernel->mem_words_moved) + " palavras movidas), falhas de alocação: " + std::to_string(kernel->mem_alloc_failures));
+
+    for (const auto &[base, size] : kernel->mem_holes)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "  livre " + std::to_string(base) + "-" + std::to_string(base + size - 1));
+    }
+  }
+
+  // Give p memory for image: a partition, or frames in paged mode.
+  // In paged mode the pages entirely inside the first text_words words are
+  // shared, read-only, with the other instances of the same image; the rest
+  // of the text, in the last partial page, is protected by the cpu.
+  bool processAllocMemory(Process *p, std::string_view name, std::span<const uint16_t> image, uint16_t text_words)
+  {
+    const uint32_t size = image.size();
+
+    if (!kernel->paging)
+    {
+      const std::optional<uint16_t> base = memAlloc(size);
+      if (!base)
+      {
+        return false;
+      }
+
+      p->base_addr = *base;
+      p->limit_addr = *base + size;
+      return true;
+    }
+
+    const uint32_t npages = (size + Config::page_size_words - 1) / Config::page_size_words;
+    const uint32_t nshared = std::min<uint32_t>(text_words, size) / Config::page_size_words;
+
+    p->text = nullptr;
+    if (nshared > 0)
+    {
+      p->text = sharedTextAcquire(name, image, nshared);
+      if (p->text == nullptr)
+      {
+        kernel->mem_alloc_failures++;
+        return false;
+      }
+    }
+
+    // demand paging takes frames on first touch, and fails then if there are none
+    if (!kernel->demand_paging && (npages - nshared) > kernel->free_frames.size())
+    {
+      if (p->text != nullptr)
+      {
+        sharedTextRelease(p->text);
+        p->text = nullptr;
+      }
+      kernel->mem_alloc_failures++;
+      return false;
+    }
+
+    p->page_table.resize(npages);
+    for (uint32_t i = 0; i < npages; ++i)
+    {
+      Arch::PageTableEntry &pte = p->page_table[i];
+      pte.present = true;
+
+      if (i < nshared)
+      {
+        pte.frame = p->text->frames[i];
+        pte.writable = false;
+      }
+      else if (kernel->demand_paging)
+      {
+        pte.frame = 0;
+        pte.present = false;
+        pte.writable = true;
+      }
+      else
+      {
+        pte.frame = kernel->free_frames.back();
+        pte.writable = true;
+        kernel->free_frames.pop_back();
+      }
+    }
+
+    p->base_addr = 0;
+    p->limit_addr = size;
+    return true;
+  }
+
+  void processFreeMemory(Process *p)
+  {
+    if (!kernel->paging)
+    {
+      memFree(p->base_addr, p->limit_addr - p->base_addr);
+      return;
+    }
+
+    const uint32_t nshared = (p->text != nullptr) ? p->text->frames.size() : 0;
+
+    for (uint32_t i = nshared; i < p->page_table.size(); ++i)
+    {
+      if (p->page_table[i].present)
+      {
+        kernel->free_frames.push_back(p->page_table[i].frame);
+      }
+    }
+    p->page_table.clear();
+
+    if (p->text != nullptr)
+    {
+      sharedTextRelease(p->text);
+      p->text = nullptr;
+    }
+  }
+
+  // Shared text for the first npages pages of image. An existing one is reused
+  // only if it has the same name and the same contents; a new one gets frames,
+  // which processLoad fills. Returns nullptr if there are not enough frames.
+  SharedText *sharedTextAcquire(std::string_view name, std::span<const uint16_t> image, uint32_t npages)
+  {
+    for (SharedText &text : kernel->shared_texts)
+    {
+      if (text.name != name || text.frames.size() != npages)
+      {
+        continue;
+      }
+
+      bool same = true;
+      for (uint32_t i = 0; i < npages * Config::page_size_words && same; ++i)
+      {
+        same = c->pmem_read(text.frames[i / Config::page_size_words] * Config::page_size_words + (i % Config::page_size_words)) == image[i];
+      }
+
+      if (same)
+      {
+        text.refs++;
+        return &text;
+      }
+    }
+
+    if (npages > kernel->free_frames.size())
+    {
+      return nullptr;
+    }
+
+    SharedText &text = kernel->shared_texts.emplace_back();
+    text.name = name;
+    text.refs = 1;
+    for (uint32_t i = 0; i < npages; ++i)
+    {
+      text.frames.push_back(kernel->free_frames.back());
+      kernel->free_frames.pop_back();
+    }
+
+    return &text;
+  }
+
+  void sharedTextRelease(SharedText *text)
+  {
+    if (--text->refs > 0)
+    {
+      return;
+    }
+
+    kernel->free_frames.insert(kernel->free_frames.end(), text->frames.begin(), text->frames.end());
+    kernel->shared_texts.remove_if([text](const SharedText &entry) { return &entry == text; });
+  }
+
+  // Demand paging: give a frame to a page of p on its first touch and copy its part of the image.
+  // Returns false if there is no free frame. Pages that are already present are left alone.
+  bool processPageIn(Process *p, uint32_t vpage)
+  {
+    if (!kernel->paging || p->page_table[vpage].present)
+    {
+      return true;
+    }
+
+    if (kernel->free_frames.empty())
+    {
+      return false;
+    }
+
+    static constexpr std::array<uint16_t, Config::page_size_words> zero_page{};
+
+    Arch::PageTableEntry &pte = p->page_table[vpage];
+    pte.frame = kernel->free_frames.back();
+    kernel->free_frames.pop_back();
+
+    // the part of the last page past the end of the image is zeroed
+    const std::span<const uint16_t> image = p->image;
+    const uint32_t offset = vpage * Config::page_size_words;
+    const uint32_t n = (offset < image.size()) ? std::min<uint32_t>(Config::page_size_words, image.size() - offset) : 0;
+
+    c->pmem_copy(pte.frame * Config::page_size_words, image.subspan(offset, n));
+    c->pmem_copy(pte.frame * Config::page_size_words + n, std::span(zero_page).first(Config::page_size_words - n));
+
+    // the tlb never holds pages that are not present, no flush needed
+    pte.present = true;
+    p->pages_loaded++;
+    kernel->demand_page_ins++;
+
+    return true;
+  }
+
+  // Appends the characters of length words of p at vaddr to out, stopping at a NUL if until_nul.
+  // The range must be inside the process. Copies a page at a time, paging it in if needed.
+  // Returns false if a page could not be paged in.
+  bool processGather(Process *p, uint16_t vaddr, uint32_t length, bool until_nul, std::string &out)
+  {
+    out.reserve(out.size() + (until_nul ? 64 : length));
+
+    const uint32_t end = vaddr + length;
+    uint32_t addr = vaddr;
+
+    while (addr < end)
+    {
+      if (!processPageIn(p, addr / Config::page_size_words))
+      {
+        return false;
+      }
+
+      // physical memory is contiguous up to the end of the page, or the whole range in base+limit mode
+      const uint32_t chunk_end = kernel->paging ? std::min<uint32_t>(end, (addr / Config::page_size_words + 1) * Config::page_size_words) : end;
+      const uint16_t paddr = processPaddr(p, addr);
+
+      for (uint32_t i = 0; i < (chunk_end - addr); i++)
+      {
+        const uint16_t ch = c->pmem_read(paddr + i);
+        if (until_nul && ch == 0)
+        {
+          return true;
+        }
+        out.push_back(static_cast<char>(ch));
+      }
+
+      addr = chunk_end;
+    }
+
+    return true;
+  }
+
+  // Physical address of a virtual address of p, vaddr must be inside the process
+  uint16_t processPaddr(const Process *p, uint16_t vaddr)
+  {
+    if (!kernel->paging)
+    {
+      return p->base_addr + vaddr;
+    }
+
+    const Arch::PageTableEntry &pte = p->page_table[vaddr / Config::page_size_words];
+    return pte.frame * Config::page_size_words + (vaddr % Config::page_size_words);
+  }
+
+  // Charge the cycles since the last update to running or waiting time
+  void processAccount(Process *p)
+  {
+    // measured with the clock of the core of p, every core has its own
+    const uint64_t now = Arch::get_cycle(p->core);
+
+    if (p->status == ProcessStatus::exec)
+    {
+      p->run_cycles += now - p->last_cycle;
+    }
+    else if (p->status == ProcessStatus::ready)
+    {
+      p->wait_cycles += now - p->last_cycle;
+    }
+
+    p->last_cycle = now;
+  }
+
+  void processInit()
+  {
+    processTableInit();
+    memInit();
+
+    const std::shared_ptr<const Lib::MappedFile> file = image_cache.get_file("idle.bin");
+    const std::span<const uint16_t> image = file->words();
+    if (image.empty())
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Erro ao carregar idle.bin");
+      return;
+    }
+
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      Process *p = &kernel->process_table[i];
+
+      if (!processAllocMemory(p, "idle.bin", image, 0))
+      {
+        kernel->t->println(Arch::Terminal::Type::Kernel, "Erro: memória insuficiente para idle.bin");
+        return;
+      }
+
+      kernel->nprocesses++;
+      p->id = i;
+      p->begin = true;
+      p->name = "idle.bin";
+      p->status = ProcessStatus::exec;
+      p->pc = 0;
+      p->gprs.fill(0);
+      p->text_words = 0;
+      p->image.clear();
+      if (kernel->demand_paging)
+      {
+        p->image.assign(image.begin(), image.end());
+      }
+      p->pages_loaded = 0;
+      p->level = 0;
+      p->ticks = 0;
+      p->run_cycles = 0;
+      p->wait_cycles = 0;
+      p->last_cycle = Arch::get_cycle(i);
+      p->core = i;
+      p->last_core = Config::max_cores;
+      p->killed = false;
+
+      processLoad(p, image);
+      kernel->cores[i].idle = p;
+    }
+  }
+
+  Process *processCreate(std::string_view name, uint16_t pc, uint16_t text_words)
+  {
+    // may raise, so it comes before the slot is taken
+    const std::shared_ptr<const Lib::MappedFile> file = image_cache.get_file(name);
+    const std::span<const uint16_t> image = file->words();
+    if (image.empty())
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Erro ao carregar ") + std::string(name));
+      return nullptr;
+    }
+
+    Process *p = processAlloc();
+    if (p == nullptr)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Erro: tabela de processos cheia.");
+      return nullptr;
+    }
+
+    // p is still unused here, so a compaction triggered by memAlloc skips it
+    if (!processAllocMemory(p, name, image, text_words))
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Erro: memória insuficiente para ") + std::string(name));
+      processRelease(p);
+      return nullptr;
+    }
+
+    p->begin = false;
+    p->name = name;
+    p->status = ProcessStatus::ready;
+    p->pc = pc;
+    p->gprs.fill(0);
+    p->text_words = std::min<uint32_t>(text_words, image.size());
+    // the file may be rebuilt while the process runs, and the pages not loaded must
+    // still come from the program it was started with
+    p->image.clear();
+    if (kernel->demand_paging)
+    {
+      p->image.assign(image.begin(), image.end());
+    }
+    p->pages_loaded = 0;
+    p->level = 0;
+    p->ticks = 0;
+    p->run_cycles = 0;
+    p->wait_cycles = 0;
+    p->last_cycle = Arch::get_cycle();
+    p->core = core->id;
+    p->last_core = Config::max_cores;
+    p->killed = false;
+
+    processLoad(p, image);
+
+    return p;
+  }
+
+  // Copy the program image to the process memory region.
+  // Pages are contiguous in physical memory, so each one is a single bulk copy.
+  void processLoad(Process *p, std::span<const uint16_t> image)
+  {
+    // a shared text used by other processes is already in memory
+    const uint32_t first = (p->text != nullptr && p->text->refs > 1) ? p->text->frames.size() * Config::page_size_words : 0;
+
+    for (uint32_t offset = first; offset < image.size(); offset += Config::page_size_words)
+    {
+      // demand paging, copied on first touch
+      if (kernel->paging && !p->page_table[offset / Config::page_size_words].present)
+      {
+        continue;
+      }
+
+      const uint32_t n = std::min<uint32_t>(Config::page_size_words, image.size() - offset);
+      c->pmem_copy(processPaddr(p, offset), image.subspan(offset, n));
+    }
+  }
+
+  // Remove p from the system, idle is never destroyed
+  void processDestroy(Process *p)
+  {
+    if (isIdle(p))
+    {
+      return;
+    }
+
+    // it is running on another core, which destroys it at its next timer interrupt
+    if (p->status == ProcessStatus::exec && p != core->current)
+    {
+      p->killed = true;
+      return;
+    }
+
+    outputFlush(p);
+    processFreeMemory(p);
+
+    if (p == core->current)
+    {
+      // nothing to save, the next process takes the cpu
+      core->current = nullptr;
+      processRelease(p);
+      processRun();
+    }
+    else
+    {
+      readyRemove(p);
+      processRelease(p);
+    }
+
+#ifdef CONFIG_HEADLESS
+    // With no shell to load another program, the run is over once only the idle
+    // processes are left; a replay goes on, its events may still load programs
+    if (kernel->nprocesses == kernel->ncores && !Arch::get_machine()->is_replaying())
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Nenhum processo restante, encerrando o sistema...");
+      c->turn_off();
+    }
+#endif
+  }
+
+  // Append guest output to the buffer of p, flushing it as the policy says
+  void outputWrite(Process *p, std::string_view str)
+  {
+    while (!str.empty())
+    {
+      const std::size_t n = std::min<std::size_t>(str.size(), Config::output_buffer_chars - p->output.size());
+      p->output.append(str.substr(0, n));
+      str.remove_prefix(n);
+
+      if (p->output.size() == Config::output_buffer_chars)
+      {
+        outputFlush(p);
+      }
+    }
+
+    if (kernel->output_flush == Config::OutputFlush::Line && p->output.find('\n') != std::string::npos)
+    {
+      outputFlush(p);
+    }
+  }
+
+  // Print the buffer of p with a single print, tagging the lines it starts
+  void outputFlush(Process *p)
+  {
+    if (p->output.empty())
+    {
+      return;
+    }
+
+    const std::string tag = "[" + std::to_string(p->id) + "] ";
+    std::string str;
+    str.reserve(p->output.size() + 2 * tag.size());
+
+    // another process left a line unfinished
+    if (!kernel->output_line_start && kernel->output_last_pid != p->id)
+    {
+      str.push_back('\n');
+      kernel->output_line_start = true;
+    }
+
+    // a line at a time
+    for (std::size_t pos = 0; pos < p->output.size();)
+    {
+      if (kernel->output_line_start)
+      {
+        str.append(tag);
+      }
+
+      const std::size_t nl = p->output.find('\n', pos);
+      const std::size_t end = (nl == std::string::npos) ? p->output.size() : nl + 1;
+      str.append(p->output, pos, end - pos);
+      kernel->output_line_start = (nl != std::string::npos);
+      pos = end;
+    }
+
+    kernel->t->print_str(Arch::Terminal::Type::App, str);
+    kernel->output_last_pid = p->id;
+    kernel->output_flushes++;
+    p->output.clear();
+  }
+
+  void outputFlushAll()
+  {
+    for (Process &p : kernel->process_table)
+    {
+      outputFlush(&p);
+    }
+  }
+
+  // Dispatch the first ready process, or the idle of this core if there is none
+  void processRun()
+  {
+    Process *next = readyDequeue();
+    if (next == nullptr)
+    {
+      next = core->idle;
+    }
+
+    processDispatch(next);
+  }
+
+  // Make p the running process of this core and restore its context in the cpu.
+  // The previous process is saved and, unless it is idle, goes to the end of this core's ready queue.
+  void processDispatch(Process *p)
+  {
+    if (core->current == p)
+    {
+      return;
+    }
+
+    if (core->current != nullptr)
+    {
+      processSave();
+      processAccount(core->current);
+      core->current->status = ProcessStatus::ready;
+      if (!isIdle(core->current))
+      {
+        readyEnqueue(core->current);
+      }
+    }
+
+    core->current = p;
+    processAccount(p);
+    p->status = ProcessStatus::exec;
+
+    if (kernel->ncores > 1 && p->last_core != core->id)
+    {
+      processInvalidate(p);
+      p->last_core = core->id;
+    }
+
+    c->set_profile_owner(p->id);
+
+    if (kernel->paging)
+    {
+      c->set_page_table(p->page_table.data(), p->page_table.size());
+    }
+    else
+    {
+      c->set_vmem_paddr_init(p->base_addr);
+      c->set_vmem_paddr_end(p->limit_addr - 1);
+    }
+    c->set_vmem_text_words(p->text_words);
+    c->set_pc(p->pc);
+    for (uint8_t i = 0; i < p->gprs.size(); ++i)
+    {
+      c->set_gpr(i, p->gprs[i]);
+    }
+  }
+
+  // Stores only invalidate the decoded instructions of the core that runs them,
+  // so this core may hold stale ones for the memory of p, from when it last ran here
+  // or from a previous owner of its frames
+  void processInvalidate(Process *p)
+  {
+    if (kernel->paging)
+    {
+      for (const Arch::PageTableEntry &pte : p->page_table)
+      {
+        if (pte.present)
+        {
+          c->invalidate_decode_cache(pte.frame * Config::page_size_words, Config::page_size_words);
+        }
+      }
+    }
+    else
+    {
+      c->invalidate_decode_cache(p->base_addr, p->limit_addr - p->base_addr);
+    }
+  }
+
+  void processSave()
+  {
+    core->current->pc = c->get_pc();
+    for (uint8_t i = 0; i < core->current->gprs.size(); ++i)
+    {
+      core->current->gprs[i] = c->get_gpr(i);
+    }
+  }
+
+  void processStatus()
+  {
+    if (core->current->status == ProcessStatus::exec)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Process " + core->current->name + " is running");
+    }
+    else if (core->current->status == ProcessStatus::ready)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Process " + core->current->name + " is ready");
+    }
+
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Base Address: 0x" + std::to_string(core->current->base_addr));
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Limit Address: 0x" + std::to_string(core->current->limit_addr));
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Program Counter: 0x" + std::to_string(core->current->pc));
+    kernel->t->println(Arch::Terminal::Type::Kernel, "General Purpose Registers: " + std::to_string(core->current->gprs.size()));
+
+    processAccount(core->current);
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Run/Wait cycles: " + std::to_string(core->current->run_cycles) + "/" + std::to_string(core->current->wait_cycles));
+
+    if (kernel->demand_paging)
+    {
+      kernel->t->println(Arch::Terminal::Type::Kernel, "Pages loaded on demand: " + std::to_string(core->current->pages_loaded) + "/" + std::to_string(core->current->page_table.size()));
+    }
+  }
+
+  void processList()
+  {
+    kernel->t->println(Arch::Terminal::Type::Kernel, "Processos: " + std::to_string(kernel->nprocesses) + "/" + std::to_string(Config::max_processes));
+    kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Escalonador: ") + ((kernel->policy == Config::SchedulerPolicy::RoundRobin) ? "round-robin" : "mlfq") + ", " + std::to_string(kernel->timer_ticks) + " ticks");
+    kernel->t->println(Arch::Terminal::Type::Kernel, std::string("Saída: ") + ((kernel->output_flush == Config::OutputFlush::Line) ? "line" : (kernel->output_flush == Config::OutputFlush::Tick) ? "tick" : "full") + ", " + std::to_string(kernel->output_flushes) + " flushes");
+
+    std::string per_core = "Núcleos: " + std::to_string(kernel->ncores);
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      per_core += ", " + std::to_string(i) + ": pid " + std::to_string(kernel->cores[i].current->id) + " (" + std::to_string(kernel->cores[i].nready) + " prontos, " + std::to_string(kernel->cores[i].steals) + " roubados)";
+    }
+    kernel->t->println(Arch::Terminal::Type::Kernel, per_core);
+
+    kernel->t->println(Arch::Terminal::Type::Kernel, "PID   STATUS  BASE   LIMIT  PC     NIVEL RUN          WAIT         NOME");
+
+    for (Process &p : kernel->process_table)
+    {
+      if (p.status == ProcessStatus::unused)
+      {
+        continue;
+      }
+
+      processAccount(&p);
+
+      char line[96];
+      snprintf(line, sizeof(line), "%-5u %-7s %-6u %-6u %-6u %-5u %-12llu %-12llu ", p.id, (p.status == ProcessStatus::exec) ? "exec" : "ready", p.base_addr, p.limit_addr, p.pc, p.level,
+               static_cast<unsigned long long>(p.run_cycles), static_cast<unsigned long long>(p.wait_cycles));
+      kernel->t->println(Arch::Terminal::Type::Kernel, line + p.name);
+    }
+  }
+
+  // The kernel of a machine that is booting or resuming, replacing any previous one
+  void kernelCreate(Arch::Machine &machine)
+  {
+    Arch::Terminal *terminal = machine.get_terminal();
+    const std::span<Arch::Cpu *const> cpus = machine.get_cpus();
+
+    terminal->println(Arch::Terminal::Type::Command, "Type commands here");
+    terminal->println(Arch::Terminal::Type::App, "Apps output here");
+    terminal->println(Arch::Terminal::Type::Kernel, "Kernel output here");
+
+    const std::shared_ptr<Kernel> state = std::make_shared<Kernel>();
+    machine.set_kernel(state);
+    kernel = state.get();
+
+    kernel->t = terminal;
+    kernel->ncores = cpus.size();
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      kernel->cores[i].id = i;
+      kernel->cores[i].cpu = cpus[i];
+    }
+    core = &kernel->cores[0];
+    c = core->cpu;
+  }
+
+  uint16_t snapshotSlot(const Process *p)
+  {
+    return (p == nullptr) ? snapshot_none : static_cast<uint16_t>(p - kernel->process_table.data());
+  }
+
+  Process *snapshotProcess(uint16_t slot)
+  {
+    if (slot == snapshot_none)
+    {
+      return nullptr;
+    }
+
+    mylib_assert_exception_msg(slot < Config::max_processes, "invalid process slot ", slot, " in snapshot")
+    return &kernel->process_table[slot];
+  }
+
+  void kernelSave(Lib::WordWriter &out)
+  {
+    out.put(std::to_underlying(kernel->policy));
+    out.put(kernel->paging);
+    out.put(kernel->demand_paging);
+    out.put(std::to_underlying(kernel->output_flush));
+    out.put(std::to_underlying(kernel->mem_fit));
+    out.put64(kernel->timer_ticks);
+    out.put64(kernel->demand_page_ins);
+    out.put(kernel->output_last_pid);
+    out.put(kernel->output_line_start);
+    out.put64(kernel->output_flushes);
+    out.put64(kernel->mem_compactions);
+    out.put64(kernel->mem_words_moved);
+    out.put64(kernel->mem_alloc_failures);
+
+    out.put32(kernel->free_frames.size());
+    out.put_words(kernel->free_frames);
+
+    out.put32(kernel->mem_holes.size());
+    for (const auto &[base, size] : kernel->mem_holes)
+    {
+      out.put32(base);
+      out.put32(size);
+    }
+
+    out.put32(kernel->shared_texts.size());
+    for (const SharedText &text : kernel->shared_texts)
+    {
+      out.put_str(text.name);
+      out.put32(text.frames.size());
+      out.put_words(text.frames);
+      out.put32(text.refs);
+    }
+
+    // Unused slots only keep their pid and free list link
+    out.put32(kernel->nprocesses);
+    out.put(snapshotSlot(kernel->free_list));
+
+    for (const Process &p : kernel->process_table)
+    {
+      out.put(p.id);
+      out.put(p.status);
+      out.put(snapshotSlot(p.next));
+
+      if (p.status == ProcessStatus::unused)
+      {
+        continue;
+      }
+
+      uint16_t text = snapshot_none;
+      if (p.text != nullptr)
+      {
+        const auto it = std::find_if(kernel->shared_texts.begin(), kernel->shared_texts.end(), [&p](const SharedText &t) { return &t == p.text; });
+        text = static_cast<uint16_t>(std::distance(kernel->shared_texts.begin(), it));
+      }
+
+      out.put(snapshotSlot(p.prev));
+      out.put(p.begin);
+      out.put_str(p.name);
+      out.put(p.pc);
+      out.put_words(p.gprs);
+      out.put(p.base_addr);
+      out.put(p.limit_addr);
+      out.put32(p.page_table.size());
+      for (const Arch::PageTableEntry &entry : p.page_table)
+      {
+        out.put(entry.frame);
+        out.put(entry.present | (entry.writable << 1));
+      }
+      out.put(p.text_words);
+      out.put(text);
+      out.put32(p.pages_loaded);
+      out.put_str(p.output);
+      out.put(p.level);
+      out.put32(p.ticks);
+      out.put64(p.run_cycles);
+      out.put64(p.wait_cycles);
+      out.put64(p.last_cycle);
+      out.put(p.core);
+      out.put(p.last_core);
+      out.put(p.killed);
+
+      // demand paging: the pages not loaded yet, the program file may have changed since
+      if (kernel->demand_paging)
+      {
+        out.put32(p.image.size());
+        for (uint32_t offset = 0; offset < p.image.size(); offset += Config::page_size_words)
+        {
+          if (!p.page_table[offset / Config::page_size_words].present)
+          {
+            const uint32_t n = std::min<uint32_t>(Config::page_size_words, p.image.size() - offset);
+            out.put_words(std::span<const uint16_t>(p.image).subspan(offset, n));
+          }
+        }
+      }
+    }
+
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      const Core &k = kernel->cores[i];
+
+      out.put(snapshotSlot(k.current));
+      out.put(snapshotSlot(k.idle));
+      for (const ReadyQueue &queue : k.ready_queues)
+      {
+        out.put(snapshotSlot(queue.head));
+        out.put(snapshotSlot(queue.tail));
+      }
+      out.put32(k.nready);
+      out.put64(k.ticks);
+      out.put64(k.steals);
+    }
+  }
+
+  // Mirrors kernelSave, on a kernel fresh from kernelCreate
+  void kernelRestore(Lib::WordReader &in)
+  {
+    const uint16_t policy = in.get();
+    mylib_assert_exception_msg(policy <= std::to_underlying(Config::SchedulerPolicy::MultilevelFeedback), "invalid scheduler policy in snapshot")
+    kernel->policy = static_cast<Config::SchedulerPolicy>(policy);
+    kernel->paging = in.get();
+    kernel->demand_paging = in.get();
+
+    const uint16_t output_flush = in.get();
+    mylib_assert_exception_msg(output_flush <= std::to_underlying(Config::OutputFlush::Full), "invalid output flush in snapshot")
+    kernel->output_flush = static_cast<Config::OutputFlush>(output_flush);
+
+    const uint16_t mem_fit = in.get();
+    mylib_assert_exception_msg(mem_fit <= std::to_underlying(Config::MemoryFit::BestFit), "invalid memory fit in snapshot")
+    kernel->mem_fit = static_cast<Config::MemoryFit>(mem_fit);
+
+    kernel->timer_ticks = in.get64();
+    kernel->demand_page_ins = in.get64();
+    kernel->output_last_pid = in.get();
+    kernel->output_line_start = in.get();
+    kernel->output_flushes = in.get64();
+    kernel->mem_compactions = in.get64();
+    kernel->mem_words_moved = in.get64();
+    kernel->mem_alloc_failures = in.get64();
+
+    const std::span<const uint16_t> free_frames = in.get_words(in.get32());
+    kernel->free_frames.assign(free_frames.begin(), free_frames.end());
+
+    for (uint32_t n = in.get32(); n > 0; n--)
+    {
+      const uint32_t base = in.get32();
+      kernel->mem_holes[base] = in.get32();
+    }
+
+    std::vector<SharedText *> texts;
+    for (uint32_t n = in.get32(); n > 0; n--)
+    {
+      SharedText &text = kernel->shared_texts.emplace_back();
+      text.name = in.get_str();
+      const std::span<const uint16_t> frames = in.get_words(in.get32());
+      text.frames.assign(frames.begin(), frames.end());
+      text.refs = in.get32();
+      texts.push_back(&text);
+    }
+
+    kernel->nprocesses = in.get32();
+    kernel->free_list = snapshotProcess(in.get());
+
+    for (Process &p : kernel->process_table)
+    {
+      p.id = in.get();
+      const uint16_t status = in.get();
+      mylib_assert_exception_msg(status <= ProcessStatus::ready, "invalid process status in snapshot")
+      p.status = static_cast<ProcessStatus>(status);
+      p.next = snapshotProcess(in.get());
+      p.prev = nullptr;
+      p.text = nullptr;
+
+      if (p.status == ProcessStatus::unused)
+      {
+        continue;
+      }
+
+      p.prev = snapshotProcess(in.get());
+      p.begin = in.get();
+      p.name = in.get_str();
+      p.pc = in.get();
+      const std::span<const uint16_t> gprs = in.get_words(p.gprs.size());
+      std::copy(gprs.begin(), gprs.end(), p.gprs.begin());
+      p.base_addr = in.get();
+      p.limit_addr = in.get();
+      p.page_table.resize(in.get32());
+      for (Arch::PageTableEntry &entry : p.page_table)
+      {
+        entry.frame = in.get();
+        const uint16_t flags = in.get();
+        entry.present = flags & 0x01;
+        entry.writable = flags & 0x02;
+      }
+      p.text_words = in.get();
+
+      const uint16_t text = in.get();
+      if (text != snapshot_none)
+      {
+        mylib_assert_exception_msg(text < texts.size(), "invalid shared text in snapshot")
+        p.text = texts[text];
+      }
+
+      p.pages_loaded = in.get32();
+      p.output = in.get_str();
+      p.level = in.get();
+      p.ticks = in.get32();
+      p.run_cycles = in.get64();
+      p.wait_cycles = in.get64();
+      p.last_cycle = in.get64();
+      p.core = in.get();
+      p.last_core = in.get();
+      p.killed = in.get();
+
+      // the pages loaded are never copied again, they are left zero
+      if (kernel->demand_paging)
+      {
+        p.image.assign(in.get32(), 0);
+        mylib_assert_exception_msg(p.image.size() <= (p.page_table.size() * Config::page_size_words), "invalid image size in snapshot")
+
+        for (uint32_t offset = 0; offset < p.image.size(); offset += Config::page_size_words)
+        {
+          if (!p.page_table[offset / Config::page_size_words].present)
+          {
+            const uint32_t n = std::min<uint32_t>(Config::page_size_words, p.image.size() - offset);
+            const std::span<const uint16_t> words = in.get_words(n);
+            std::copy(words.begin(), words.end(), p.image.begin() + offset);
+          }
+        }
+      }
+    }
+
+    for (uint32_t i = 0; i < kernel->ncores; i++)
+    {
+      Core &k = kernel->cores[i];
+
+      k.current = snapshotProcess(in.get());
+      k.idle = snapshotProcess(in.get());
+      for (ReadyQueue &queue : k.ready_queues)
+      {
+        queue.head = snapshotProcess(in.get());
+        queue.tail = snapshotProcess(in.get());
+      }
+      k.nready = in.get32();
+      k.ticks = in.get64();
+      k.steals = in.get64();
+
+      mylib_assert_exception_msg(k.current != nullptr && k.idle != nullptr, "core ", i, " without a process in snapshot")
+    }
   }
 } // end namespace OS
@@ -13,12 +13,45 @@ namespace OS {
 
 // ---------------------------------------
 
-void boot (Arch::Terminal *terminal, Arch::Cpu *cpu);
+struct BootOptions {
+	Config::SchedulerPolicy scheduler_policy = Config::scheduler_policy;
+	bool paging = Config::paging;
+	bool demand_paging = Config::demand_paging;
+	Config::OutputFlush output_flush = Config::output_flush;
+};
+
+// starts a fresh kernel on the machine, its state is kept by the machine (Arch::Machine::set_kernel)
+// every cpu of the machine is a core sharing the memory, the kernel schedules processes across them
+void boot (Arch::Machine& machine, const BootOptions& options = BootOptions());
+
+// like boot, but the machine and its kernel resume from a snapshot (see save_snapshot),
+// or from a checkpoint and the chain of snapshots it was taken on top of,
+// boot options included; the machine must have as many cores as the saved one
+// raises Mylib::Exception in case of error
+void resume (Arch::Machine& machine, const std::string_view fname);
+
+// the functions below work on the kernel of the calling thread's machine, see Arch::get_machine
 
 void interrupt (const Arch::InterruptCode interrupt);
 
 void syscall ();
 
+// saves the running process and dispatches the next ready one, if any
+void context_switch ();
+
+// loads the program and makes it the running process
+// the first text_words words are code: write-protected, and shared
+// between instances of the same program in paged mode
+// raises Mylib::Exception in case of error
+void load_program (const std::string_view fname, const uint16_t text_words = 0);
+
+// writes the machine and its kernel to fname, returns the size in bytes
+// an incremental snapshot (checkpoint) only has the memory pages written since the
+// previous snapshot saved or resumed, and needs it (and its own chain) to be resumed
+// only machines with a single core can be saved
+// raises Mylib::Exception in case of error
+uint64_t save_snapshot (const std::string_view fname, const bool incremental = false);
+
 // ---------------------------------------
 
 } // end namespace